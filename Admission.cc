@@ -0,0 +1,160 @@
+#include <QDebug>
+#include <QDateTime>
+#include <QtEndian>
+
+#include "Admission.hh"
+
+// Rates are in work units per second. A unit is roughly the cost of
+// deserializing a small map; an RSA signature check is about ten.
+#define NODE_RATE (2000)
+#define NODE_BURST (2000)
+#define NEIGHBOR_RATE (400)
+#define NEIGHBOR_BURST (800)
+#define STRANGER_RATE (40)
+#define STRANGER_BURST (100)
+
+// Units credited for each reply we're waiting for: a private, and the
+// fragments of a block reply. Credit is capped so that replies that never
+// come can't pile up an allowance for someone else to spend.
+#define REPLY_CREDIT (40)
+#define MAX_REPLY_CREDIT (REPLY_CREDIT * 512)
+
+// Most automatic neighbors, and how fast new ones may be added
+#define MAX_AUTO_NEIGHBORS (64)
+#define NEW_NEIGHBOR_RATE (1)
+#define NEW_NEIGHBOR_BURST (8)
+
+// Source buckets are forgotten once they've been idle this long, in ms, or
+// when there are too many
+#define SOURCE_IDLE (60000)
+#define MAX_SOURCES (4096)
+
+// Largest datagram accepted, after reassembly, and most entries in a
+// top-level map. No message has more than a dozen top-level entries.
+#define MAX_DATAGRAM_BYTES (256 * 1024)
+#define MAX_MAP_ENTRIES (16)
+
+// Work units charged for each kind of traffic
+static const int KIND_COST[Admission::NUM_KINDS] =
+{
+    20, // Search: signature check and file index lookup
+    2,  // Summary
+    12, // Rumor: signature check
+    1,  // Relay: header only
+    1,  // Fragment: header only
+    25, // Private: signature check and decryption
+    2   // Control
+};
+
+// Fraction of the node's bucket each kind leaves for the kinds after it
+static const double KIND_RESERVE[Admission::NUM_KINDS] =
+{
+    0.5, 0.4, 0.3, 0.2, 0.2, 0.1, 0.0
+};
+
+Admission::Admission()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    m_node.m_tokens = NODE_BURST;
+    m_node.m_refilled = now;
+    m_newNeighbors.m_tokens = NEW_NEIGHBOR_BURST;
+    m_newNeighbors.m_refilled = now;
+    m_replyCredit = 0;
+    m_dropped = 0;
+}
+
+void Admission::refill(Bucket& bucket, qint64 now, double rate, double burst)
+{
+    bucket.m_tokens = qMin(bucket.m_tokens + (now - bucket.m_refilled) * rate / 1000.0,
+                           burst);
+    bucket.m_refilled = now;
+}
+
+bool Admission::admit(const QHostAddress& address, quint16 port, Kind kind, bool known)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    int cost = KIND_COST[kind];
+    double rate = known ? NEIGHBOR_RATE : STRANGER_RATE;
+    double burst = known ? NEIGHBOR_BURST : STRANGER_BURST;
+
+    NeighborKey key(address, port);
+    QHash<NeighborKey, Bucket>::iterator it = m_sources.find(key);
+    if (it == m_sources.end())
+    {
+        if (m_sources.count() >= MAX_SOURCES)
+        {
+            // Forget idle sources; if none are, a flood of new sources
+            // can't be told apart, so forget them all
+            QHash<NeighborKey, Bucket>::iterator old = m_sources.begin();
+            while (old != m_sources.end())
+            {
+                if (now - old.value().m_refilled > SOURCE_IDLE) old = m_sources.erase(old);
+                else ++old;
+            }
+            if (m_sources.count() >= MAX_SOURCES) m_sources.clear();
+        }
+
+        Bucket fresh;
+        fresh.m_tokens = burst;
+        fresh.m_refilled = now;
+        it = m_sources.insert(key, fresh);
+    }
+
+    Bucket& source = it.value();
+    refill(source, now, rate, burst);
+    refill(m_node, now, NODE_RATE, NODE_BURST);
+
+    if (source.m_tokens < cost
+        || m_node.m_tokens - cost < KIND_RESERVE[kind] * NODE_BURST)
+    {
+        // Replies we asked for are limited by how fast we ask, not by the
+        // buckets. Any source may be carrying them, since they can come
+        // straight from the replier or through any of our neighbors.
+        if ((kind == Private || kind == Fragment) && m_replyCredit >= cost)
+        {
+            m_replyCredit -= cost;
+            return true;
+        }
+
+        // Log now and then rather than for every datagram of a flood
+        if (m_dropped++ % 100 == 0)
+        {
+            qDebug() << "Shedding load: dropped " << m_dropped << " datagrams, latest of kind "
+                << kind << " from " << address.toString() << ":" << port;
+        }
+        return false;
+    }
+
+    source.m_tokens -= cost;
+    m_node.m_tokens -= cost;
+    return true;
+}
+
+void Admission::expectReply()
+{
+    m_replyCredit = qMin(m_replyCredit + REPLY_CREDIT, MAX_REPLY_CREDIT);
+}
+
+bool Admission::allowNewNeighbor(int autoNeighbors)
+{
+    if (autoNeighbors >= MAX_AUTO_NEIGHBORS) return false;
+
+    refill(m_newNeighbors,
+           QDateTime::currentMSecsSinceEpoch(),
+           NEW_NEIGHBOR_RATE,
+           NEW_NEIGHBOR_BURST);
+    if (m_newNeighbors.m_tokens < 1) return false;
+
+    m_newNeighbors.m_tokens -= 1;
+    return true;
+}
+
+bool Admission::wellFormed(const QByteArray& datagram, bool isPrivate)
+{
+    if (datagram.size() < 4 || datagram.size() > MAX_DATAGRAM_BYTES) return false;
+
+    // A private's map follows its header, which is checked as it's read.
+    // Anything else starts with the entry count of its map.
+    if (isPrivate) return true;
+    return qFromBigEndian<quint32>((const uchar*)datagram.constData()) <= MAX_MAP_ENTRIES;
+}
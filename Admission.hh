@@ -0,0 +1,81 @@
+#ifndef ADMISSION_HH
+#define ADMISSION_HH
+
+#include <QHostAddress>
+#include <QHash>
+
+#include "NeighborTable.hh"
+
+// Decides which incoming datagrams are worth the work of handling them,
+// before any signature checks, decryption or file searches. Each source
+// has a token bucket of work units, and so does the node as a whole. A kind
+// of traffic is admitted only while the node's bucket has more than its
+// reserve. Traffic that is cheap to lose has the largest reserve, so it's
+// shed first as load rises.
+class Admission
+{
+public:
+    // Kinds of incoming traffic, in the order they're shed
+    enum Kind
+    {
+        // Search requests; the flood reaches other nodes anyway
+        Search,
+        // File name summaries; the next one replaces a lost one
+        Summary,
+        // Rumors; anti-entropy recovers lost ones
+        Rumor,
+        // Privates for other nodes
+        Relay,
+        // Fragments of larger datagrams
+        Fragment,
+        // Privates for us
+        Private,
+        // Status messages and liveness probes
+        Control,
+        NUM_KINDS
+    };
+
+    Admission();
+
+    // Returns true if a datagram of the given kind from address:port should
+    // be handled, and charges its cost. known is true if the source is a
+    // neighbor.
+    bool admit(const QHostAddress& address, quint16 port, Kind kind, bool known);
+
+    // Credits the allowance for replies to our own requests, which admits
+    // privates and fragments the buckets would shed. Called for each
+    // request sent.
+    void expectReply();
+
+    // Returns true if a sender may be added as a neighbor automatically,
+    // given how many automatic neighbors there are already
+    bool allowNewNeighbor(int autoNeighbors);
+
+    // Cheap sanity check of a datagram before it's deserialized. Returns
+    // false if it can't be a valid message.
+    static bool wellFormed(const QByteArray& datagram, bool isPrivate);
+
+private:
+    struct Bucket
+    {
+        double m_tokens;
+
+        // Time the bucket was last refilled, in ms since the epoch
+        qint64 m_refilled;
+    };
+
+    // Refills a bucket at rate units per ms, up to burst units
+    static void refill(Bucket& bucket, qint64 now, double rate, double burst);
+
+    QHash<NeighborKey, Bucket> m_sources;
+    Bucket m_node;
+    Bucket m_newNeighbors;
+
+    // Work units left for replies to our requests
+    int m_replyCredit;
+
+    // Number of datagrams dropped, for the debug log
+    int m_dropped;
+};
+
+#endif // ADMISSION_HH
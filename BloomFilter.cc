@@ -0,0 +1,120 @@
+#include "BloomFilter.hh"
+#include "FileIndex.hh"
+
+void BloomFilter::hash(const QString& key, quint32* h1, quint32* h2)
+{
+    // FNV-1a over the UTF-16 code units, then a second mix for h2
+    quint32 h = 2166136261u;
+    for (int i = 0; i < key.size(); i++)
+    {
+        ushort c = key[i].unicode();
+        h = (h ^ (c & 0xff)) * 16777619u;
+        h = (h ^ (c >> 8)) * 16777619u;
+    }
+    *h1 = h;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    *h2 = h | 1;
+}
+
+void BloomFilter::insert(const QString& key)
+{
+    quint32 h1, h2;
+    hash(key, &h1, &h2);
+    for (int i = 0; i < NUM_HASHES; i++)
+    {
+        quint32 bit = (h1 + i * h2) % BITS;
+        m_bits[bit / 8] = m_bits[bit / 8] | (char)(1 << (bit % 8));
+    }
+    m_empty = false;
+}
+
+bool BloomFilter::contains(const QString& key) const
+{
+    if (m_empty) return false;
+
+    quint32 h1, h2;
+    hash(key, &h1, &h2);
+    for (int i = 0; i < NUM_HASHES; i++)
+    {
+        quint32 bit = (h1 + i * h2) % BITS;
+        if (!(m_bits[bit / 8] & (1 << (bit % 8)))) return false;
+    }
+    return true;
+}
+
+void BloomFilter::unite(const BloomFilter& other)
+{
+    if (other.m_empty) return;
+
+    char* bits = m_bits.data();
+    const char* otherBits = other.m_bits.constData();
+    for (int i = 0; i < BYTES; i++) bits[i] |= otherBits[i];
+    m_empty = false;
+}
+
+bool BloomFilter::fromByteArray(const QByteArray& data)
+{
+    clear();
+    if (data.size() != BYTES) return false;
+
+    m_bits = data;
+    m_empty = true;
+    for (int i = 0; i < BYTES && m_empty; i++)
+    {
+        if (m_bits[i]) m_empty = false;
+    }
+    return true;
+}
+
+void BloomFilter::insertName(const QString& name)
+{
+    QStringList tokens = FileIndex::tokenize(name);
+    for (int i = 0; i < tokens.count(); i++)
+    {
+        const QString& token = tokens[i];
+        if (token.size() < 3)
+        {
+            insert(token);
+        }
+        for (int pos = 0; pos + 3 <= token.size(); pos++)
+        {
+            insert(token.mid(pos, 3));
+        }
+    }
+}
+
+bool BloomFilter::mightMatch(const QString& term) const
+{
+    QString lower = term.toLower();
+    if (lower.size() < 3) return true;
+
+    // Only trigrams within tokens are inserted, so a term that spans tokens
+    // can't be ruled out
+    for (int i = 0; i < lower.size(); i++)
+    {
+        if (!lower[i].isLetterOrNumber()) return true;
+    }
+
+    for (int pos = 0; pos + 3 <= lower.size(); pos++)
+    {
+        if (!contains(lower.mid(pos, 3))) return false;
+    }
+    return true;
+}
+
+bool BloomFilter::mightMatchAny(const QString& searchTerms) const
+{
+    if (m_empty) return false;
+
+    QStringList terms = searchTerms.split(" ", QString::SkipEmptyParts);
+    for (int i = 0; i < terms.count(); i++)
+    {
+        if (mightMatch(terms[i])) return true;
+    }
+    return false;
+}
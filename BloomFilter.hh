@@ -0,0 +1,56 @@
+#ifndef BLOOM_FILTER_HH
+#define BLOOM_FILTER_HH
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+
+// Fixed-size Bloom filter over strings, used to summarize the names of the
+// files a node shares. The hash is defined here rather than taken from
+// qHash so that every node computes the same bits.
+class BloomFilter
+{
+public:
+    BloomFilter() : m_bits(BYTES, '\0'), m_empty(true) { }
+
+    void insert(const QString& key);
+    bool contains(const QString& key) const;
+
+    // Adds every key in other to this filter
+    void unite(const BloomFilter& other);
+
+    bool isEmpty() const { return m_empty; }
+    void clear() { m_bits.fill('\0'); m_empty = true; }
+
+    // Network representation of the filter
+    QByteArray toByteArray() const { return m_bits; }
+    // Returns false and leaves the filter empty if data isn't a filter
+    bool fromByteArray(const QByteArray& data);
+
+    // Inserts the keys that describe a file name: the trigrams of its
+    // tokens, and tokens too short to have trigrams
+    void insertName(const QString& name);
+
+    // True if a file whose name contains term might have been inserted with
+    // insertName. Terms under three characters always might match.
+    bool mightMatch(const QString& term) const;
+
+    // True if mightMatch is true for any of the space-separated terms
+    bool mightMatchAny(const QString& searchTerms) const;
+
+private:
+    enum
+    {
+        BYTES = 1024,
+        BITS = BYTES * 8,
+        NUM_HASHES = 4
+    };
+
+    // Computes the two base hashes for double hashing
+    static void hash(const QString& key, quint32* h1, quint32* h2);
+
+    QByteArray m_bits;
+    bool m_empty;
+};
+
+#endif // BLOOM_FILTER_HH
@@ -9,6 +9,8 @@
 #include "ChatDialog.hh"
 #include "NetSocket.hh"
 #include "FileStore.hh"
+#include "Dht.hh"
+#include "Search.hh"
 #include "finalProject/crypto.hh"
 
 #define BROADCAST "Send to All"
@@ -19,8 +21,6 @@ ChatDialog::ChatDialog()
 {
     setWindowTitle("Peerster");
 
-    m_pSearch = NULL;
-
     // Read-only text box where we display messages from everyone.
     // This widget expands both horizontally and vertically.
     m_pChatView = new QTextEdit(this);
@@ -50,15 +50,22 @@ ChatDialog::ChatDialog()
     // button to download a file
     m_pDownloadFileButton = new QPushButton("Download File from Selected Peer...", this);
 
+    // priority of new downloads; higher priorities get a larger share of
+    // the download rate
+    m_pPriority = new QSpinBox(this);
+    m_pPriority->setPrefix("Download priority: ");
+    m_pPriority->setRange(1, 10);
+    m_pPriority->setValue(1);
+
     m_pChallengeButton = new QPushButton("Trust Challenge Selected Peer...", this);
 
     // button to search for a file
     m_pSearchFileButton = new QPushButton("Search for File...", this);
 
-    m_pSearchResults = new QTableWidget(0, 3, this);
+    m_pSearchResults = new QTableWidget(0, 4, this);
     setSearchResultHeaders();
 
-    m_pCancelSearchButton = new QPushButton("Clear Search");
+    m_pCancelSearchButton = new QPushButton("Clear Searches");
     m_pRepeatSearchButton = new QPushButton("Repeat Current Search");
 
     // List of all files currently being shared by this node
@@ -79,6 +86,7 @@ ChatDialog::ChatDialog()
     m_pSendLayout = new QVBoxLayout();
     m_pSendLayout->addWidget(m_pSendOptions);
     m_pSendLayout->addWidget(m_pDownloadFileButton);
+    m_pSendLayout->addWidget(m_pPriority);
     m_pSendLayout->addWidget(m_pChallengeButton);
     m_pSendLayout->addWidget(m_pMessageBox);
 
@@ -199,6 +207,7 @@ void ChatDialog::setSearchResultHeaders()
     headers.append("Name");
     headers.append("Origin");
     headers.append("Hash");
+    headers.append("Search");
     m_pSearchResults->setHorizontalHeaderLabels(headers);
 }
 
@@ -256,13 +265,13 @@ void ChatDialog::printMessage(MessageInfo& mesInf)
         seqNo.setNum(mesInf.m_seqNo);
 
         QString chatText("[");
-        chatText.append(mesInf.m_host);
+        chatText.append(mesInf.host());
         chatText.append(", ");
         chatText.append(seqNo);
         chatText.append("] ");
         chatText.append(mesInf.m_body);
 
-        if (mesInf.m_goodSig || mesInf.m_host == GlobalSocket->m_hostName)
+        if (mesInf.m_goodSig || mesInf.m_originId == GlobalSocket->m_hostId)
         {
             m_pChatView->setTextColor(Qt::black);
         }
@@ -304,6 +313,11 @@ void ChatDialog::addOriginForPrivates(QString& host)
     m_pSendOptions->addItem(host);
 }
 
+void ChatDialog::addSharedFile(const QString& fileName)
+{
+    m_pSharedFiles->addItem(fileName);
+}
+
 void ChatDialog::showShareFileDialog()
 {
     QStringList shareFiles = QFileDialog::getOpenFileNames(
@@ -344,12 +358,7 @@ void ChatDialog::showShareDirDialog()
 void ChatDialog::newDownloadFile()
 {
     QString host = m_pSendOptions->currentItem()->text();
-    if (host == BROADCAST)
-    {
-        qDebug() << "Select a peer from whom to download; cannot download from 'Send to All'";
-        return;
-    }
-    else if (host == GlobalSocket->m_hostName)
+    if (host == GlobalSocket->m_hostName)
     {
         qDebug() << "Cannot download a file from self";
         return;
@@ -367,7 +376,15 @@ void ChatDialog::newDownloadFile()
     qDebug() << "Host: " << host;
     qDebug() << "Hash: " << hash.toHex();
 
-    GlobalFiles->addDownloadFile(fileName, hash, host);
+    if (host == BROADCAST)
+    {
+        // Find a node sharing the file; the download starts once one is found
+        GlobalDht->findProvider(fileName, hash, m_pPriority->value());
+    }
+    else
+    {
+        GlobalFiles->addDownloadFile(fileName, hash, host, m_pPriority->value());
+    }
 }
 
 void ChatDialog::searchForFile()
@@ -380,33 +397,21 @@ void ChatDialog::searchForFile()
 
 void ChatDialog::createSearch(QString& terms)
 {
-    // Check if we have a search already going; only run 1 search at a time
-    if (m_pSearch)
-    {
-        qDebug() << "WE ALREADY HAVE SEARCH RUNNING";
-        return;
-    }
-
-    m_pSearch = new Search(terms);
-
-    // Connect GlobalSocket got search result signal to Search
-    connect(GlobalSocket, SIGNAL(gotSearchResult(QString&,QString&,QByteArray&,QString&)),
-            m_pSearch, SLOT(addResult(QString&,QString&,QByteArray&,QString&)));
-
-    // Connect Search new result signal to this object's slot for printing result
-    connect(m_pSearch, SIGNAL(newSearchResult(QString&,QString&,QString&)),
-            this, SLOT(printSearchResult(QString&,QString&,QString&)));
-
-    m_pSearch->beginSearch();
+    // Searches run concurrently; results of each are tagged with its terms
+    quint32 queryId = GlobalSearches->start(terms);
+    if (queryId != 0) m_searchIds.append(queryId);
 }
 
 void ChatDialog::cancelSearch()
 {
-    if (m_pSearch)
+    if (!m_searchIds.isEmpty())
     {
-        qDebug() << "Canceling search";
-        delete m_pSearch;
-        m_pSearch = NULL;
+        qDebug() << "Canceling searches";
+        for (int i = 0; i < m_searchIds.count(); i++)
+        {
+            GlobalSearches->cancel(m_searchIds[i]);
+        }
+        m_searchIds.clear();
         m_pSearchResults->clear();
         m_pSearchResults->setRowCount(0);
         setSearchResultHeaders();
@@ -419,11 +424,25 @@ void ChatDialog::cancelSearch()
 
 void ChatDialog::repeatSearch()
 {
-    if (m_pSearch)
+    Search* search = m_searchIds.isEmpty()
+        ? NULL : GlobalSearches->find(m_searchIds.last());
+    if (search)
     {
-        qDebug() << "Repeating search: " << m_pSearch->m_terms;
-        QString terms = m_pSearch->m_terms;
-        cancelSearch();
+        qDebug() << "Repeating search: " << search->m_terms;
+        QString terms = search->m_terms;
+        quint32 queryId = m_searchIds.takeLast();
+        GlobalSearches->cancel(queryId);
+
+        // Drop only this search's results; the others keep running
+        for (int row = m_pSearchResults->rowCount() - 1; row >= 0; row--)
+        {
+            QTableWidgetItem* termsItem = m_pSearchResults->item(row, 3);
+            if (termsItem && termsItem->data(Qt::UserRole).toUInt() == queryId)
+            {
+                m_pSearchResults->removeRow(row);
+            }
+        }
+
         createSearch(terms);
     }
     else
@@ -432,10 +451,15 @@ void ChatDialog::repeatSearch()
     }
 }
 
-void ChatDialog::printSearchResult(QString& fileName,
+void ChatDialog::printSearchResult(quint32 queryId,
+                                   QString& terms,
+                                   QString& fileName,
                                    QString& origin,
                                    QString& hash)
 {
+    // Results of searches not started from this dialog aren't shown
+    if (!m_searchIds.contains(queryId)) return;
+
     // Add new row for new search result
     int insertRow = m_pSearchResults->rowCount();
     m_pSearchResults->insertRow(insertRow);
@@ -444,30 +468,36 @@ void ChatDialog::printSearchResult(QString& fileName,
     QTableWidgetItem* fileItem = new QTableWidgetItem(fileName);
     QTableWidgetItem* originItem = new QTableWidgetItem(origin);
     QTableWidgetItem* hashItem = new QTableWidgetItem(hash);
+    QTableWidgetItem* termsItem = new QTableWidgetItem(terms);
+
+    // Remember which search the row belongs to, since terms may repeat
+    termsItem->setData(Qt::UserRole, queryId);
 
     // Make the items read-only
     fileItem->setFlags(fileItem->flags() ^ Qt::ItemIsEditable);
     originItem->setFlags(originItem->flags() ^ Qt::ItemIsEditable);
     hashItem->setFlags(hashItem->flags() ^ Qt::ItemIsEditable);
+    termsItem->setFlags(termsItem->flags() ^ Qt::ItemIsEditable);
 
     // Insert the items
     m_pSearchResults->setItem(insertRow, 0, fileItem);
     m_pSearchResults->setItem(insertRow, 1, originItem);
     m_pSearchResults->setItem(insertRow, 2, hashItem);
+    m_pSearchResults->setItem(insertRow, 3, termsItem);
 }
 
 void ChatDialog::searchResultDoubleClicked(int row)
 {
-    if (!m_pSearch)
+    if (m_searchIds.isEmpty())
     {
-        qDebug() << "m_pSearch is NULL, but list item was double-clicked";
+        qDebug() << "No searches, but list item was double-clicked";
         return;
     }
     QString fileName = saveFileString();
     if (fileName.isEmpty()) return;
     QByteArray fileId = QByteArray::fromHex(m_pSearchResults->item(row, 2)->text().toUtf8());
     QString host = m_pSearchResults->item(row, 1)->text();
-    GlobalFiles->addDownloadFile(fileName, fileId, host);
+    GlobalFiles->addDownloadFile(fileName, fileId, host, m_pPriority->value());
 }
 
 QString ChatDialog::saveFileString()
@@ -9,9 +9,10 @@
 #include <QPushButton>
 #include <QGroupBox>
 #include <QTableWidget>
+#include <QSpinBox>
 
 #include "messageinfo.hh"
-#include "Search.hh"
+#include "SearchManager.hh"
 #include "PrivateMessage.hh"
 
 class ChatDialog : public QDialog
@@ -33,14 +34,23 @@ public slots:
     void newDownloadFile();
     void searchForFile();
     void cancelSearch();
-    void printSearchResult(QString& fileName, QString& origin, QString& hash);
+    void printSearchResult(quint32 queryId,
+                           QString& terms,
+                           QString& fileName,
+                           QString& origin,
+                           QString& hash);
     void searchResultDoubleClicked(int row);
     void repeatSearch();
     void challenge();
     void addTrust(const QString& host);
 
+    // Lists a file we started sharing without the dialog, e.g. a finished
+    // download
+    void addSharedFile(const QString& fileName);
+
 private:
-    Search* m_pSearch;
+    // Query IDs of the searches started from this dialog, oldest first
+    QList<quint32> m_searchIds;
 
     QVBoxLayout* m_pChatLayout;
     QVBoxLayout* m_pSendLayout;
@@ -60,6 +70,7 @@ private:
     QPushButton* m_pShareDirButton;
     QListWidget* m_pSharedFiles;
     QPushButton* m_pDownloadFileButton;
+    QSpinBox* m_pPriority;
     QTableWidget* m_pSearchResults;
     QPushButton* m_pSearchFileButton;
     QPushButton* m_pCancelSearchButton;
@@ -0,0 +1,567 @@
+#include <QDebug>
+#include <QDateTime>
+#include <QtCrypto>
+
+#include "Dht.hh"
+#include "NetSocket.hh"
+#include "RouteTable.hh"
+#include "FileStore.hh"
+#include "FileIndex.hh"
+#include "Origins.hh"
+
+// Number of contacts a lookup converges on
+#define DHT_K (8)
+
+// Number of the closest nodes that store each record
+#define DHT_REPLICAS (3)
+
+// Number of queries a lookup has outstanding at a time
+#define DHT_ALPHA (3)
+
+// ms to wait for the replies to a lookup's queries
+#define LOOKUP_TIMEOUT (3000)
+
+// ms between checks for timed out lookups
+#define LOOKUP_TICK (500)
+
+// ms a stored record lives unless it's republished
+#define RECORD_TTL (3600000)
+
+// ms between sweeps for expired records
+#define EXPIRE_INTERVAL (60000)
+
+// ms between republishing our records. The first republish waits for route
+// rumors to tell us about other nodes.
+#define REPUBLISH_INTERVAL (1200000)
+#define FIRST_REPUBLISH (90000)
+
+// Bounds on the records stored for other nodes
+#define MAX_RECORDS_PER_KEY (64)
+#define MAX_RECORDS (65536)
+
+// Most keywords looked up for a single search
+#define MAX_KEYWORDS (8)
+
+// Size of node IDs and keys
+#define KEY_BYTES (32)
+
+Dht* GlobalDht;
+
+Dht::Dht()
+    : m_tickTimer(this, &Dht::tick),
+      m_republishTimer(this, &Dht::republish),
+      m_expireTimer(this, &Dht::expireRecords)
+{
+    m_numRecords = 0;
+
+    m_tickTimer.startRepeating(LOOKUP_TICK);
+    m_expireTimer.startRepeating(EXPIRE_INTERVAL);
+    m_republishTimer.start(FIRST_REPUBLISH);
+}
+
+QByteArray Dht::keywordKey(const QString& keyword)
+{
+    QCA::Hash shaHash("sha256");
+    shaHash.update(QString("keyword:" + keyword.toLower()).toUtf8());
+    return shaHash.final().toByteArray();
+}
+
+const QByteArray& Dht::nodeId(int originId)
+{
+    if (originId >= m_nodeIds.count()) m_nodeIds.resize(originId + 1);
+
+    QByteArray& id = m_nodeIds[originId];
+    if (id.isEmpty())
+    {
+        QCA::Hash shaHash("sha256");
+        shaHash.update(GlobalOrigins->name(originId).toUtf8());
+        id = shaHash.final().toByteArray();
+    }
+    return id;
+}
+
+bool Dht::closer(int a, int b, const QByteArray& key)
+{
+    const QByteArray& idA = nodeId(a);
+    const QByteArray& idB = nodeId(b);
+
+    for (int i = 0; i < KEY_BYTES; i++)
+    {
+        uchar distA = (uchar)idA[i] ^ (uchar)key[i];
+        uchar distB = (uchar)idB[i] ^ (uchar)key[i];
+        if (distA != distB) return distA < distB;
+    }
+    return false;
+}
+
+QList<int> Dht::closest(const QByteArray& key, int n)
+{
+    QList<int> nearest;
+    AddrInfo addr;
+
+    for (int id = 0; id < GlobalOrigins->count(); id++)
+    {
+        if (id != GlobalSocket->m_hostId && !GlobalRoutes->getNextHop(id, addr))
+        {
+            continue;
+        }
+
+        // Insertion into the n closest so far
+        int pos = nearest.count();
+        while (pos > 0 && closer(id, nearest[pos - 1], key)) pos--;
+        if (pos < n)
+        {
+            nearest.insert(pos, id);
+            if (nearest.count() > n) nearest.removeLast();
+        }
+    }
+    return nearest;
+}
+
+void Dht::publishFile(FileData* file)
+{
+    QVariantList fileNames;
+    QVariantList fileIds;
+    fileNames.append(file->getFriendlyName());
+    fileIds.append(file->m_fileId);
+
+    publish(file->m_fileId, fileNames, fileIds);
+
+    QStringList keywords = FileIndex::tokenize(file->getFriendlyName());
+    keywords.removeDuplicates();
+    for (int i = 0; i < keywords.count(); i++)
+    {
+        publish(keywordKey(keywords[i]), fileNames, fileIds);
+    }
+}
+
+void Dht::republish()
+{
+    m_republishTimer.start(REPUBLISH_INTERVAL);
+
+    // Group the records by key so that each key is looked up once
+    QHash<QByteArray, QPair<QVariantList, QVariantList> > byKey;
+    QList<FileData*> files = GlobalFiles->sharedFiles();
+    for (int i = 0; i < files.count(); i++)
+    {
+        QList<QByteArray> keys;
+        keys.append(files[i]->m_fileId);
+
+        QStringList keywords = FileIndex::tokenize(files[i]->getFriendlyName());
+        keywords.removeDuplicates();
+        for (int j = 0; j < keywords.count(); j++)
+        {
+            keys.append(keywordKey(keywords[j]));
+        }
+
+        for (int j = 0; j < keys.count(); j++)
+        {
+            QPair<QVariantList, QVariantList>& records = byKey[keys[j]];
+            records.first.append(files[i]->getFriendlyName());
+            records.second.append(files[i]->m_fileId);
+        }
+    }
+
+    QHash<QByteArray, QPair<QVariantList, QVariantList> >::const_iterator it;
+    for (it = byKey.constBegin(); it != byKey.constEnd(); ++it)
+    {
+        publish(it.key(), it.value().first, it.value().second);
+    }
+
+    if (!byKey.isEmpty())
+    {
+        qDebug() << "Republishing DHT records under " << byKey.count() << " keys";
+    }
+}
+
+void Dht::publish(const QByteArray& key,
+                  const QVariantList& fileNames,
+                  const QVariantList& fileIds)
+{
+    Lookup* lookup = startLookup(Publish, key, QString());
+    if (!lookup) return;
+
+    lookup->m_fileNames = fileNames;
+    lookup->m_fileIds = fileIds;
+    advance(lookup);
+}
+
+void Dht::findKeywords(const QString& searchTerms, quint32 queryId)
+{
+    QStringList keywords = FileIndex::tokenize(searchTerms);
+    keywords.removeDuplicates();
+    for (int i = 0; i < keywords.count() && i < MAX_KEYWORDS; i++)
+    {
+        Lookup* lookup = startLookup(Keyword, keywordKey(keywords[i]), searchTerms);
+        if (!lookup) continue;
+
+        lookup->m_queryId = queryId;
+        advance(lookup);
+    }
+}
+
+void Dht::findProvider(const QString& fileName, const QByteArray& fileId, int priority)
+{
+    Lookup* lookup = startLookup(Provider, fileId, fileName);
+    if (!lookup) return;
+
+    lookup->m_priority = priority;
+    advance(lookup);
+}
+
+Dht::Lookup* Dht::startLookup(LookupKind kind,
+                              const QByteArray& key,
+                              const QString& name)
+{
+    if (key.size() != KEY_BYTES)
+    {
+        qDebug() << "DHT key has the wrong size: " << key.toHex();
+        return NULL;
+    }
+
+    Lookup* lookup = new Lookup();
+    do
+    {
+        lookup->m_id = ((quint32)rand() << 16) ^ (quint32)rand();
+    } while (lookup->m_id == 0 || m_lookups.contains(lookup->m_id));
+
+    lookup->m_kind = kind;
+    lookup->m_key = key;
+    lookup->m_name = name;
+    lookup->m_shortlist = closest(key, DHT_K);
+    lookup->m_queryId = 0;
+    lookup->m_priority = 1;
+    lookup->m_deadline = 0;
+
+    m_lookups.insert(lookup->m_id, lookup);
+    return lookup;
+}
+
+void Dht::advance(Lookup* lookup)
+{
+    for (int i = 0; i < lookup->m_shortlist.count() && i < DHT_K; i++)
+    {
+        if (lookup->m_pending.count() >= DHT_ALPHA) return;
+
+        int id = lookup->m_shortlist[i];
+        if (lookup->m_queried.contains(id)) continue;
+        lookup->m_queried.insert(id);
+
+        if (id == GlobalSocket->m_hostId)
+        {
+            // Answer our own part of the lookup directly. Our contacts are
+            // already in the shortlist, so only the records matter.
+            lookup->m_responded.insert(id);
+            const QList<Record> records = m_records.value(lookup->m_key);
+            qint64 now = QDateTime::currentMSecsSinceEpoch();
+            for (int j = 0; j < records.count(); j++)
+            {
+                if (records[j].m_expires > now && !deliver(lookup, records[j]))
+                {
+                    finish(lookup);
+                    return;
+                }
+            }
+        }
+        else
+        {
+            query(lookup, id);
+        }
+    }
+
+    // Every one of the closest contacts has answered or failed
+    if (lookup->m_pending.isEmpty()) finish(lookup);
+}
+
+void Dht::query(Lookup* lookup, int originId)
+{
+    PrivateDhtFind priv(GlobalOrigins->name(originId),
+                        10,
+                        GlobalSocket->m_hostName,
+                        lookup->m_key,
+                        lookup->m_id);
+    GlobalSocket->sendPrivate(&priv);
+
+    lookup->m_pending.insert(originId);
+    lookup->m_deadline = QDateTime::currentMSecsSinceEpoch() + LOOKUP_TIMEOUT;
+}
+
+void Dht::addContact(Lookup* lookup, int originId)
+{
+    if (lookup->m_shortlist.contains(originId)
+        || lookup->m_failed.contains(originId))
+    {
+        return;
+    }
+
+    int pos = lookup->m_shortlist.count();
+    while (pos > 0 && closer(originId, lookup->m_shortlist[pos - 1], lookup->m_key))
+    {
+        pos--;
+    }
+    if (pos < DHT_K * 2)
+    {
+        lookup->m_shortlist.insert(pos, originId);
+        if (lookup->m_shortlist.count() > DHT_K * 2)
+        {
+            lookup->m_shortlist.removeLast();
+        }
+    }
+}
+
+bool Dht::deliver(Lookup* lookup, const Record& record)
+{
+    if (record.m_provider == GlobalSocket->m_hostName) return true;
+
+    QByteArray seenKey = record.m_fileId + record.m_provider.toUtf8();
+    if (lookup->m_seen.contains(seenKey)) return true;
+    lookup->m_seen.insert(seenKey);
+
+    switch (lookup->m_kind)
+    {
+        case Keyword:
+        {
+            QString fileName = record.m_fileName;
+            QByteArray fileId = record.m_fileId;
+            QString provider = record.m_provider;
+            emit gotSearchResult(lookup->m_queryId,
+                                 lookup->m_name,
+                                 fileName,
+                                 fileId,
+                                 provider);
+            return true;
+        }
+        case Provider:
+        {
+            qDebug() << "DHT found provider " << record.m_provider
+                << " for " << lookup->m_key.toHex();
+            QString fileName = lookup->m_name;
+            QByteArray fileId = lookup->m_key;
+            QString provider = record.m_provider;
+            GlobalFiles->addDownloadFile(fileName, fileId, provider, lookup->m_priority);
+            return false;
+        }
+        default:
+        {
+            return true;
+        }
+    }
+}
+
+void Dht::finish(Lookup* lookup)
+{
+    if (lookup->m_kind == Publish)
+    {
+        // Store the records on the closest nodes that answered
+        int stored = 0;
+        for (int i = 0; i < lookup->m_shortlist.count() && stored < DHT_REPLICAS; i++)
+        {
+            int id = lookup->m_shortlist[i];
+            if (!lookup->m_responded.contains(id)) continue;
+            stored++;
+
+            if (id == GlobalSocket->m_hostId)
+            {
+                store(GlobalSocket->m_hostName,
+                      lookup->m_key,
+                      lookup->m_fileNames,
+                      lookup->m_fileIds);
+            }
+            else
+            {
+                PrivateDhtStore priv(GlobalOrigins->name(id),
+                                     10,
+                                     GlobalSocket->m_hostName,
+                                     lookup->m_key,
+                                     lookup->m_fileNames,
+                                     lookup->m_fileIds);
+                GlobalSocket->sendPrivate(&priv);
+            }
+        }
+    }
+    else if (lookup->m_kind == Provider && lookup->m_seen.isEmpty())
+    {
+        qDebug() << "DHT found no provider for " << lookup->m_key.toHex();
+    }
+
+    m_lookups.remove(lookup->m_id);
+    delete lookup;
+}
+
+void Dht::tick()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    // Advancing may finish lookups, so collect the expired ones first
+    QList<Lookup*> expired;
+    QHash<quint32, Lookup*>::const_iterator it;
+    for (it = m_lookups.constBegin(); it != m_lookups.constEnd(); ++it)
+    {
+        if (!it.value()->m_pending.isEmpty() && it.value()->m_deadline < now)
+        {
+            expired.append(it.value());
+        }
+    }
+
+    for (int i = 0; i < expired.count(); i++)
+    {
+        // Contacts that didn't answer make room for the next closest
+        Lookup* lookup = expired[i];
+        QSet<int>::const_iterator pendingIt;
+        for (pendingIt = lookup->m_pending.constBegin();
+             pendingIt != lookup->m_pending.constEnd();
+             ++pendingIt)
+        {
+            lookup->m_shortlist.removeOne(*pendingIt);
+            lookup->m_failed.insert(*pendingIt);
+        }
+        lookup->m_pending.clear();
+        advance(lookup);
+    }
+}
+
+void Dht::expireRecords()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    QHash<QByteArray, QList<Record> >::iterator it = m_records.begin();
+    while (it != m_records.end())
+    {
+        QList<Record>& records = it.value();
+        for (int i = records.count() - 1; i >= 0; i--)
+        {
+            if (records[i].m_expires <= now)
+            {
+                records.removeAt(i);
+                m_numRecords--;
+            }
+        }
+
+        if (records.isEmpty())
+        {
+            it = m_records.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void Dht::store(const QString& origin,
+                const QByteArray& key,
+                const QVariantList& fileNames,
+                const QVariantList& fileIds)
+{
+    if (key.size() != KEY_BYTES) return;
+
+    qint64 expires = QDateTime::currentMSecsSinceEpoch() + RECORD_TTL;
+    int count = qMin(fileNames.count(), fileIds.count());
+    for (int i = 0; i < count; i++)
+    {
+        Record record;
+        record.m_fileName = fileNames[i].toString();
+        record.m_fileId = fileIds[i].toByteArray();
+        record.m_provider = origin;
+        record.m_expires = expires;
+        storeRecord(key, record);
+    }
+}
+
+void Dht::storeRecord(const QByteArray& key, const Record& record)
+{
+    QList<Record>& records = m_records[key];
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    // Drop expired records and any older copy of this one
+    for (int i = records.count() - 1; i >= 0; i--)
+    {
+        if (records[i].m_expires <= now
+            || (records[i].m_fileId == record.m_fileId
+                && records[i].m_provider == record.m_provider))
+        {
+            records.removeAt(i);
+            m_numRecords--;
+        }
+    }
+
+    if (records.count() >= MAX_RECORDS_PER_KEY || m_numRecords >= MAX_RECORDS)
+    {
+        qDebug() << "DHT store full; dropping record for " << record.m_fileName;
+        if (records.isEmpty()) m_records.remove(key);
+        return;
+    }
+
+    records.append(record);
+    m_numRecords++;
+}
+
+void Dht::find(const QString& origin,
+               const QByteArray& key,
+               QVariantList& nodesOut,
+               QList<Record>& recordsOut)
+{
+    if (key.size() != KEY_BYTES) return;
+
+    QList<int> nearest = closest(key, DHT_K + 2);
+    for (int i = 0; i < nearest.count() && nodesOut.count() < DHT_K; i++)
+    {
+        const QString& name = GlobalOrigins->name(nearest[i]);
+        if (nearest[i] != GlobalSocket->m_hostId && name != origin)
+        {
+            nodesOut.append(name);
+        }
+    }
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    const QList<Record> records = m_records.value(key);
+    for (int i = 0; i < records.count(); i++)
+    {
+        if (records[i].m_expires > now) recordsOut.append(records[i]);
+    }
+}
+
+void Dht::found(const QString& origin,
+                quint32 lookupId,
+                const QVariantList& nodes,
+                const QVariantList& fileNames,
+                const QVariantList& fileIds,
+                const QVariantList& providers)
+{
+    Lookup* lookup = m_lookups.value(lookupId);
+    int originId = GlobalOrigins->find(origin);
+    if (!lookup || !lookup->m_pending.contains(originId))
+    {
+        qDebug() << "Dropping late or unexpected DHT reply from " << origin;
+        return;
+    }
+
+    lookup->m_pending.remove(originId);
+    lookup->m_responded.insert(originId);
+
+    // Contacts we can't route to can't be queried
+    AddrInfo addr;
+    for (int i = 0; i < nodes.count(); i++)
+    {
+        int id = GlobalOrigins->find(nodes[i].toString());
+        if (id >= 0 && GlobalRoutes->getNextHop(id, addr)) addContact(lookup, id);
+    }
+
+    int count = qMin(fileNames.count(), qMin(fileIds.count(), providers.count()));
+    for (int i = 0; i < count; i++)
+    {
+        Record record;
+        record.m_fileName = fileNames[i].toString();
+        record.m_fileId = fileIds[i].toByteArray();
+        record.m_provider = providers[i].toString();
+        record.m_expires = 0;
+
+        if (!deliver(lookup, record))
+        {
+            finish(lookup);
+            return;
+        }
+    }
+
+    advance(lookup);
+}
@@ -0,0 +1,193 @@
+#ifndef DHT_HH
+#define DHT_HH
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QVariantList>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QVector>
+
+#include "TimerWheel.hh"
+
+class FileData;
+
+// Kademlia-style distributed table of provider records, layered on the
+// point-to-point routes. Node IDs are the SHA-256 hashes of ORIGIN names and
+// keys are either fileIds or the SHA-256 hashes of name keywords. Every node
+// we have a route to is a contact, and lookups query the nodes closest to a
+// key by XOR distance, converging on the few nodes that store its records.
+class Dht : public QObject
+{
+    Q_OBJECT
+
+public:
+    Dht();
+
+    // A file shared by a provider, stored under its fileId and under each of
+    // its name keywords
+    struct Record
+    {
+        QString m_fileName;
+        QByteArray m_fileId;
+        QString m_provider;
+
+        // Time the record expires, in ms since the epoch
+        qint64 m_expires;
+    };
+
+    // Publishes provider records for a file we share
+    void publishFile(FileData* file);
+
+    // Looks up the files whose names contain one of the keywords in
+    // searchTerms. Results are reported with gotSearchResult, tagged with
+    // queryId.
+    void findKeywords(const QString& searchTerms, quint32 queryId);
+
+    // Looks up a provider of fileId and downloads the file from the first one
+    // found, saving it as fileName, at the given download priority
+    void findProvider(const QString& fileName, const QByteArray& fileId, int priority = 1);
+
+    // Handlers for DHT privates received from origin ------------------------
+
+    // Stores the records origin published under key
+    void store(const QString& origin,
+               const QByteArray& key,
+               const QVariantList& fileNames,
+               const QVariantList& fileIds);
+
+    // Fills in the nodes we know closest to key, and any records we have
+    // stored under it
+    void find(const QString& origin,
+              const QByteArray& key,
+              QVariantList& nodesOut,
+              QList<Record>& recordsOut);
+
+    // Handles a reply to one of our lookups
+    void found(const QString& origin,
+               quint32 lookupId,
+               const QVariantList& nodes,
+               const QVariantList& fileNames,
+               const QVariantList& fileIds,
+               const QVariantList& providers);
+
+    // Key under which files with the given name keyword are stored
+    static QByteArray keywordKey(const QString& keyword);
+
+signals:
+    void gotSearchResult(quint32 queryId,
+                         QString& terms,
+                         QString& fileName,
+                         QByteArray& hash,
+                         QString& host);
+
+private:
+    enum LookupKind
+    {
+        // Find the nodes closest to the key and store records on them
+        Publish,
+        // Find records for a keyword search
+        Keyword,
+        // Find a provider for a download
+        Provider
+    };
+
+    struct Lookup
+    {
+        quint32 m_id;
+        LookupKind m_kind;
+        QByteArray m_key;
+
+        // Search terms or file name, depending on m_kind
+        QString m_name;
+
+        // Search the results of a keyword lookup are for
+        quint32 m_queryId;
+
+        // Priority of the download a provider lookup starts
+        int m_priority;
+
+        // Records to publish
+        QVariantList m_fileNames;
+        QVariantList m_fileIds;
+
+        // Contacts closest to the key found so far, closest first
+        QList<int> m_shortlist;
+        QSet<int> m_queried;
+        QSet<int> m_pending;
+        QSet<int> m_responded;
+
+        // Contacts that didn't answer in time
+        QSet<int> m_failed;
+
+        // Results already reported, as fileId followed by provider
+        QSet<QByteArray> m_seen;
+
+        // Time the pending queries time out, in ms since the epoch
+        qint64 m_deadline;
+    };
+
+    // Starts a lookup of key, registering it in m_lookups
+    Lookup* startLookup(LookupKind kind, const QByteArray& key, const QString& name);
+
+    // Publishes records for files we share under key
+    void publish(const QByteArray& key,
+                 const QVariantList& fileNames,
+                 const QVariantList& fileIds);
+
+    // Queries contacts until ALPHA are pending; finishes the lookup once
+    // the closest contacts have all been queried
+    void advance(Lookup* lookup);
+    void finish(Lookup* lookup);
+
+    // Reports a record found by a lookup. Returns false if the lookup is done.
+    bool deliver(Lookup* lookup, const Record& record);
+
+    // Sends a lookup's query to a contact
+    void query(Lookup* lookup, int originId);
+
+    // Adds a contact to a lookup's shortlist in order of distance
+    void addContact(Lookup* lookup, int originId);
+
+    // Stores a record, replacing its older copy
+    void storeRecord(const QByteArray& key, const Record& record);
+
+    // Returns the IDs of the n contacts closest to key. Includes this node.
+    QList<int> closest(const QByteArray& key, int n);
+
+    // True if a is closer to key than b
+    bool closer(int a, int b, const QByteArray& key);
+
+    const QByteArray& nodeId(int originId);
+
+    // Times out lookups
+    void tick();
+
+    // Drops expired records from every key, so they stop counting against
+    // MAX_RECORDS
+    void expireRecords();
+
+    // Publishes records for every file we share
+    void republish();
+
+    // Records stored on this node, keyed by DHT key
+    QHash<QByteArray, QList<Record> > m_records;
+    int m_numRecords;
+
+    // Lookups in progress, keyed by lookup ID
+    QHash<quint32, Lookup*> m_lookups;
+
+    // SHA-256 of each origin name, indexed by origin ID. Empty until needed.
+    QVector<QByteArray> m_nodeIds;
+
+    MemberTimer<Dht> m_tickTimer;
+    MemberTimer<Dht> m_republishTimer;
+    MemberTimer<Dht> m_expireTimer;
+};
+
+extern Dht* GlobalDht;
+
+#endif // DHT_HH
@@ -0,0 +1,132 @@
+#include <QDebug>
+#include <QDateTime>
+
+#include "DownloadScheduler.hh"
+#include "FileData.hh"
+
+// Bytes charged for each request: the size of the block it asks for
+#define REQUEST_BYTES (8192)
+
+// Default caps across all downloads
+#define MAX_REQUESTS (32)
+#define DEFAULT_RATE (4 * 1024 * 1024)
+
+// Most bytes of requests the token bucket can save up
+#define RATE_BURST (16 * REQUEST_BYTES)
+
+// Pass a download advances by per request at priority 1
+#define STRIDE (1 << 16)
+
+DownloadScheduler* GlobalDownloads;
+
+DownloadScheduler::DownloadScheduler()
+    : m_waitTimer(this, &DownloadScheduler::schedule)
+{
+    m_maxRequests = MAX_REQUESTS;
+    m_rate = DEFAULT_RATE / 1000.0;
+    m_tokens = RATE_BURST;
+    m_refilled = QDateTime::currentMSecsSinceEpoch();
+}
+
+int DownloadScheduler::find(FileData* file)
+{
+    for (int i = 0; i < m_downloads.count(); i++)
+    {
+        if (m_downloads[i].m_file == file) return i;
+    }
+    return -1;
+}
+
+void DownloadScheduler::add(FileData* file, int priority)
+{
+    if (find(file) >= 0) return;
+
+    // Start level with the download furthest behind, so a new download
+    // neither jumps the queue nor waits for the others to catch up
+    Download download;
+    download.m_file = file;
+    download.m_priority = qMax(priority, 1);
+    download.m_pass = 0;
+    for (int i = 0; i < m_downloads.count(); i++)
+    {
+        if (i == 0 || m_downloads[i].m_pass < download.m_pass)
+        {
+            download.m_pass = m_downloads[i].m_pass;
+        }
+    }
+    m_downloads.append(download);
+
+    schedule();
+}
+
+void DownloadScheduler::remove(FileData* file)
+{
+    int i = find(file);
+    if (i < 0) return;
+
+    m_downloads.removeAt(i);
+    schedule();
+}
+
+void DownloadScheduler::setMaxRequests(int maxRequests)
+{
+    m_maxRequests = qMax(maxRequests, 1);
+    schedule();
+}
+
+void DownloadScheduler::setRate(int bytesPerSec)
+{
+    refill();
+    m_rate = qMax(bytesPerSec, REQUEST_BYTES) / 1000.0;
+    schedule();
+}
+
+void DownloadScheduler::refill()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    m_tokens = qMin(m_tokens + (now - m_refilled) * m_rate, (double)RATE_BURST);
+    m_refilled = now;
+}
+
+void DownloadScheduler::schedule()
+{
+    int inFlight = 0;
+    for (int i = 0; i < m_downloads.count(); i++)
+    {
+        inFlight += m_downloads[i].m_file->outstanding();
+    }
+
+    refill();
+    while (inFlight < m_maxRequests)
+    {
+        // Lowest pass among the downloads with a request to send
+        int next = -1;
+        for (int i = 0; i < m_downloads.count(); i++)
+        {
+            if (!m_downloads[i].m_file->wantsRequest()) continue;
+            if (next < 0 || m_downloads[i].m_pass < m_downloads[next].m_pass)
+            {
+                next = i;
+            }
+        }
+        if (next < 0) return;
+
+        if (m_tokens < REQUEST_BYTES)
+        {
+            if (!m_waitTimer.isActive())
+            {
+                m_waitTimer.start((int)((REQUEST_BYTES - m_tokens) / m_rate) + 1);
+            }
+            return;
+        }
+
+        // A block another request already asks for costs nothing
+        Download& download = m_downloads[next];
+        if (download.m_file->sendRequest())
+        {
+            m_tokens -= REQUEST_BYTES;
+            download.m_pass += STRIDE / download.m_priority;
+            inFlight++;
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef DOWNLOAD_SCHEDULER_HH
+#define DOWNLOAD_SCHEDULER_HH
+
+#include <QList>
+
+#include "TimerWheel.hh"
+
+class FileData;
+
+// Decides which download sends the next block request. All downloads share a
+// cap on the requests in flight and a token bucket that limits how many bytes
+// per second they may request. Downloads take turns by stride scheduling:
+// each request advances a download's pass by a stride inversely proportional
+// to its priority, and the download with the lowest pass that wants to send
+// goes next. A download at priority 2 thus gets twice the share of one at
+// priority 1 while both are busy, and whatever share an idle download leaves
+// goes to the others.
+class DownloadScheduler
+{
+public:
+    DownloadScheduler();
+
+    // Adds a download and sends its first requests if there's room. Higher
+    // priorities get a larger share; the lowest is 1.
+    void add(FileData* file, int priority = 1);
+
+    // Removes a download that finished, failed or is being deleted, and
+    // gives its share to the others
+    void remove(FileData* file);
+
+    // Sends requests for downloads until the caps are reached or none wants
+    // to send. Called whenever a download's requests complete.
+    void schedule();
+
+    // Sets the most block requests in flight across all downloads
+    void setMaxRequests(int maxRequests);
+
+    // Sets the most bytes per second all downloads may request together
+    void setRate(int bytesPerSec);
+
+private:
+    struct Download
+    {
+        FileData* m_file;
+        int m_priority;
+
+        // Position in the schedule; the lowest goes next
+        qint64 m_pass;
+    };
+
+    // Index of file in m_downloads, or -1
+    int find(FileData* file);
+
+    // Adds tokens for the time since the last refill
+    void refill();
+
+    QList<Download> m_downloads;
+
+    int m_maxRequests;
+
+    // Rate in bytes per ms, and the tokens available
+    double m_rate;
+    double m_tokens;
+    qint64 m_refilled;
+
+    // Runs schedule once there are tokens for another request
+    MemberTimer<DownloadScheduler> m_waitTimer;
+};
+
+extern DownloadScheduler* GlobalDownloads;
+
+#endif // DOWNLOAD_SCHEDULER_HH
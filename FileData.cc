@@ -3,45 +3,62 @@
 #include <QDebug>
 
 #include "FileData.hh"
+#include "FileStore.hh"
 #include "NetSocket.hh"
+#include "DownloadScheduler.hh"
 
 #define BLOCKSIZE (8192)
 #define SHA_SIZE (32)
-#define MAX_TIMEOUTS (10)
+
+// Most block requests a download keeps outstanding
+#define MAX_IN_FLIGHT (8)
 
 FileData::FileData(QString& fileName, QByteArray& fileId, QString& host)
 {
     m_isSharing = false;
     m_blocklist.clear();
-    m_remHashes.clear();
+    m_remaining = 0;
     m_fileId = fileId;
-    m_name = fileName;
+    setName(fileName);
     m_size = -1;
     m_host = host;
-    setupTimer();
+    m_nextRequest = 0;
+    m_outstanding = 0;
 }
 
 FileData::FileData(QString& fileName)
 {
+    m_isSharing = false;
+    m_remaining = 0;
+    m_nextRequest = 0;
+    m_outstanding = 0;
     open(fileName);
-    setupTimer();
 }
 
-void FileData::setupTimer()
+FileData::~FileData()
 {
-    m_timeouts = 0;
-    m_pTimer = new QTimer(this);
-    m_pTimer->setInterval(2000);
-    connect(m_pTimer, SIGNAL(timeout()), this, SLOT(timeout()));
+    GlobalRpc->cancel(this);
+    GlobalDownloads->remove(this);
+
+    if (!m_isSharing)
+    {
+        if (m_blocklist.isEmpty()) GlobalFiles->forgetBlock(m_fileId, this);
+
+        QList<QByteArray> hashes = m_inFlight.uniqueKeys();
+        for (int i = 0; i < hashes.count(); i++)
+        {
+            GlobalFiles->forgetBlock(hashes[i], this);
+        }
+    }
 }
 
 bool FileData::open(QString& fileName)
 {
     // Clear existing data in case this FileData object is being reused.
     m_blocklist.clear();
-    m_remHashes.clear();
+    m_remaining = 0;
     m_fileId.clear();
-    m_name.clear();
+    setName(QString());
     m_size = 0;
 
     // Open the file and check for errors
@@ -87,7 +104,7 @@ bool FileData::open(QString& fileName)
 
     // Populate remaining fields.
     m_size = file.size();
-    m_name = fileName;
+    setName(fileName);
     m_isSharing = true;
 
     // Print debug info
@@ -139,38 +156,44 @@ qint64 FileData::findBlock(QByteArray& hash)
     }
 }
 
-void FileData::requestBlock()
+bool FileData::wantsRequest()
 {
-    if (m_isSharing)
-    {
-        qDebug() << "Trying to request blocks for a file being shared";
-        return;
-    }
-    else if (fileComplete())
-    {
-        qDebug() << "Trying to request blocks for a complete file";
-        return;
-    }
+    if (m_isSharing || fileComplete()) return false;
+    if (m_outstanding >= MAX_IN_FLIGHT) return false;
 
+    if (m_blocklist.isEmpty()) return m_outstanding == 0;
+    return m_nextRequest < m_data.count();
+}
+
+bool FileData::sendRequest()
+{
+    QString& hostName = GlobalSocket->m_hostName;
     if (m_blocklist.isEmpty())
     {
         qDebug() << "REQUESTING BLOCKLIST: " << m_name;
-        GlobalSocket->requestBlock(m_fileId, m_host);
-        m_timeouts = 0;
-        m_pTimer->start();
+        GlobalFiles->expectBlock(m_fileId, this);
+        GlobalRpc->call(new PrivateBlockReq(m_host, 10, m_fileId, hostName), m_fileId, this);
+        m_outstanding++;
+        return true;
     }
-    else
+
+    while (m_nextRequest < m_data.count())
     {
-        qDebug() << "REQUESTING BLOCK for file: " << m_name;
-        if (m_remHashes.isEmpty())
+        int index = m_nextRequest++;
+        QByteArray hash = m_blocklist.mid(index * SHA_SIZE, SHA_SIZE);
+
+        bool requested = m_inFlight.contains(hash);
+        m_inFlight.insert(hash, index);
+        if (!requested)
         {
-            qDebug() << "    NEED BLOCK, BUT CANNOT FIND NEEDED BLOCK!!!!";
+            qDebug() << "REQUESTING BLOCK " << index << " for file: " << m_name;
+            GlobalFiles->expectBlock(hash, this);
+            GlobalRpc->call(new PrivateBlockReq(m_host, 10, hash, hostName), hash, this);
+            m_outstanding++;
+            return true;
         }
-
-        GlobalSocket->requestBlock(m_remHashes[0], m_host);
-        m_timeouts = 0;
-        m_pTimer->start();
     }
+    return false;
 }
 
 bool FileData::addBlock(QByteArray& hash, QByteArray& block)
@@ -188,53 +211,97 @@ bool FileData::addBlock(QByteArray& hash, QByteArray& block)
         return false;
     }
 
+    return storeBlock(hash, block);
+}
+
+bool FileData::storeBlock(const QByteArray& hash, const QByteArray& block)
+{
+    if (m_isSharing) return false;
+
     // Check if it's the blocklist before checking if it's a normal block
     if (hash == m_fileId)
     {
-        m_pTimer->stop();
+        if (!m_blocklist.isEmpty()) return false;
+
         qDebug() << "    GOT BLOCKLIST for file: " << m_name;
+        GlobalFiles->forgetBlock(m_fileId, this);
         m_blocklist = block;
+        m_outstanding--;
+
+        // Make room for every block
+        m_remaining = m_blocklist.size() / SHA_SIZE;
+        for (int i = 0; i < m_remaining; i++) m_data.append(QByteArray());
+        GlobalFiles->shareBlocklist(this);
 
-        // Populate blockHash by breaking down blocklist
-        QByteArray cpBlocklist = block;
-        qint64 i;
-        for (i = 0; !cpBlocklist.isEmpty(); i++)
+        GlobalDownloads->schedule();
+        return false;
+    }
+
+    // Fill in every block we requested with this hash
+    QList<int> indices = m_inFlight.values(hash);
+    if (indices.isEmpty()) return false;
+    m_inFlight.remove(hash);
+    m_outstanding--;
+    GlobalFiles->forgetBlock(hash, this);
+
+    qDebug() << "    GOT BLOCK";
+    for (int i = 0; i < indices.count(); i++)
+    {
+        if (m_data[indices[i]].isNull())
         {
-            m_remHashes.append(cpBlocklist.left(SHA_SIZE));
-            cpBlocklist.remove(0, SHA_SIZE);
+            m_data[indices[i]] = block;
+            m_remaining--;
+            GlobalFiles->shareBlock(hash, this, indices[i]);
         }
+    }
 
-        // Request a new block
-        requestBlock();
+    // Are we done? If so, save the file
+    if (fileComplete())
+    {
+        qDebug() << "    FILE COMPLETE: " << m_name;
+        save();
+        return true;
+    }
+    else
+    {
+        GlobalDownloads->schedule();
         return false;
     }
+}
 
-    // Check if this is one of our normal blocks. If this equals the head of
-    // m_remHashes,then it's a block we requested
-    if (!m_remHashes.isEmpty() && m_remHashes[0] == hash)
-    {
-        m_pTimer->stop();
+void FileData::shareDownload()
+{
+    m_isSharing = true;
+    m_size = 0;
+    for (int i = 0; i < m_data.count(); i++) m_size += m_data[i].size();
+}
 
-        // Add the block to our data and obtained block set
-        qDebug() << "    GOT BLOCK";
-        m_data.append(block);
-        m_remHashes.removeAt(0);
+void FileData::replied(const QByteArray& key, PrivateMessage* reply)
+{
+    if (reply->type() != PrivateMessage::BlockRep) return;
 
-        // Are we done? If so, save the file
-        if (fileComplete())
-        {
-            qDebug() << "    FILE COMPLETE: " << m_name;
-            save();
-            return true;
-        }
-        else
-        {
-            requestBlock();
-            return false;
-        }
+    PrivateBlockRep* blockRep = (PrivateBlockRep*)reply;
+    if (blockRep->m_hash != key) return;
+
+    // Completing the download may delete this FileData, so it comes last
+    if (addBlock(blockRep->m_hash, blockRep->m_data))
+    {
+        GlobalFiles->finishDownload(this);
     }
+}
 
-    return false;
+void FileData::failed(const QByteArray& key)
+{
+    // Replies without a request ID don't end the call, so it can fail after
+    // the block has arrived
+    bool wanted = (key == m_fileId) ? m_blocklist.isEmpty() : m_inFlight.contains(key);
+    if (!wanted) return;
+
+    qDebug() << "Giving up on downloading file: " << m_name
+        << ", no reply for " << key.toHex().data();
+
+    // This deletes the FileData, so it comes last
+    GlobalFiles->failDownload(this);
 }
 
 bool FileData::save()
@@ -255,28 +322,8 @@ bool FileData::save()
     return true;
 }
 
-QString FileData::getFriendlyName()
+void FileData::setName(const QString& fileName)
 {
-    QStringList strList = m_name.split('/');
-    return strList.last();
-}
-
-void FileData::timeout()
-{
-    m_pTimer->stop();
-    m_timeouts++;
-
-    if (m_timeouts > MAX_TIMEOUTS)
-    {
-        qDebug() << "Giving up on downloading file: " << m_name;
-    }
-    else if (m_isSharing)
-    {
-        qDebug() << "Timeout on a FileData being shared: " << m_name;
-    }
-    else
-    {
-        qDebug() << "TIMEOUT. Resending a request: " << m_name;
-        requestBlock();
-    }
+    m_name = fileName;
+    m_friendlyName = fileName.section('/', -1);
 }
@@ -1,21 +1,19 @@
 #ifndef FILE_DATA_HH
 #define FILE_DATA_HH
 
-#include <QObject>
 #include <QString>
 #include <QByteArray>
 #include <QHash>
 #include <QList>
 #include <QSet>
-#include <QTimer>
+#include <QMultiHash>
+
+#include "Rpc.hh"
 
 // Contains data for a single file being shared on the network
-class FileData : public QObject
+class FileData : public RpcCaller
 {
-    Q_OBJECT
-
 public:
-    FileData() { }
 
     // Create FileData for file we're downloading. Saves the file as fileName
     // when we're done downloading it.
@@ -24,6 +22,8 @@ public:
     // Opens a file on this node
     FileData(QString& fileName);
 
+    ~FileData();
+
     // Functions for sharing -----------------------------------------------
 
     // Returns true if successful; false if failed
@@ -38,17 +38,37 @@ public:
     // block exists.
     qint64 findBlock(QByteArray& hash);
 
-    // Adds a downloaded block. Verifies the hash before adding it.
-    // Saves the file and returns TRUE if the file's complete.
+    // Adds a downloaded block we requested. Verifies the hash before adding
+    // it. Saves the file and returns TRUE if the file's complete.
     bool addBlock(QByteArray& hash, QByteArray& block);
 
-    void requestBlock();
+    // Like addBlock, for a block whose hash has already been verified
+    bool storeBlock(const QByteArray& hash, const QByteArray& block);
+
+    // True if the download has a request to send and fewer than
+    // MAX_IN_FLIGHT outstanding
+    bool wantsRequest();
+
+    // Requests the blocklist, or the next block not already requested.
+    // Returns false if there was nothing new to request. Called by
+    // GlobalDownloads, which decides when each download may send.
+    bool sendRequest();
+
+    // Number of requests sent and not yet answered
+    int outstanding() { return m_outstanding; }
+
+    // Turns a complete download into a file we share
+    void shareDownload();
 
     bool fileComplete()
     {
-        return !m_blocklist.isEmpty() && m_remHashes.isEmpty();
+        return !m_blocklist.isEmpty() && m_remaining == 0;
     }
 
+    // Replies to our block requests, from GlobalRpc
+    void replied(const QByteArray& key, PrivateMessage* reply);
+    void failed(const QByteArray& key);
+
     // True if this is a file we're sharing on the network.
     // False if this is a file we're downloading.
     bool m_isSharing;
@@ -59,18 +79,19 @@ public:
     // Fully qualified name of the file
     QString m_name;
 
-    QString getFriendlyName();
+    // File name without its directory
+    const QString& getFriendlyName() { return m_friendlyName; }
 
     // Size of the file in bytes
     qint64 m_size;
 
     // File content. Each element is a block. File is reconstructed by
-    // appending the blocks together.
+    // appending the blocks together. While downloading, blocks we don't
+    // have yet are null.
     QList<QByteArray> m_data;
 
-    // Remaining hashes for this file. m_remHashes[0] is the hash of the next
-    // block that needs to be appended to m_data.
-    QList<QByteArray> m_remHashes;
+    // Number of blocks we don't have yet
+    int m_remaining;
 
     // Concatenation of the 32-byte SHA-256 hashes for each 8 KB block
     QByteArray m_blocklist;
@@ -78,17 +99,25 @@ public:
     // SHA-256 hash of m_blocklist
     QByteArray m_fileId;
 
-public slots:
-    void timeout();
-
 private:
     // Saves the downloaded file. True if successful.
     bool save();
 
-    void setupTimer();
+    // Sets m_name and m_friendlyName
+    void setName(const QString& fileName);
+
+    QString m_friendlyName;
+
+    // Index of the next block to request
+    int m_nextRequest;
+
+    // Indices of the blocks requested but not received, keyed by hash.
+    // Identical blocks share one request.
+    QMultiHash<QByteArray, int> m_inFlight;
 
-    QTimer* m_pTimer;
-    int m_timeouts;
+    // Number of distinct requests in m_inFlight, or 1 while the blocklist
+    // is requested
+    int m_outstanding;
 };
 
 #endif
@@ -0,0 +1,172 @@
+#include "FileIndex.hh"
+#include "FileData.hh"
+
+quint64 FileIndex::gramKey(const QString& str, int pos, int n)
+{
+    quint64 key = (quint64)n << 48;
+    for (int i = 0; i < n; i++)
+    {
+        key |= (quint64)str[pos + i].unicode() << (16 * (2 - i));
+    }
+    return key;
+}
+
+QSet<quint64> FileIndex::grams(const QString& name)
+{
+    QSet<quint64> result;
+    for (int pos = 0; pos < name.size(); pos++)
+    {
+        for (int n = 1; n <= 3 && pos + n <= name.size(); n++)
+        {
+            result.insert(gramKey(name, pos, n));
+        }
+    }
+    return result;
+}
+
+QStringList FileIndex::tokenize(const QString& name)
+{
+    QStringList tokens;
+    QString token;
+    for (int i = 0; i < name.size(); i++)
+    {
+        if (name[i].isLetterOrNumber())
+        {
+            token.append(name[i].toLower());
+        }
+        else if (!token.isEmpty())
+        {
+            tokens.append(token);
+            token.clear();
+        }
+    }
+    if (!token.isEmpty()) tokens.append(token);
+    return tokens;
+}
+
+int FileIndex::score(const QString& name, const QString& searchTerms)
+{
+    QString lower = name.toLower();
+    QStringList nameTokens = tokenize(name);
+    QStringList terms = searchTerms.toLower().split(' ', QString::SkipEmptyParts);
+
+    int total = 0;
+    for (int i = 0; i < terms.count(); i++)
+    {
+        if (nameTokens.contains(terms[i]))
+        {
+            total += 3;
+        }
+        else if (lower.contains(terms[i]))
+        {
+            total += 1;
+        }
+
+        if (lower.startsWith(terms[i])) total += 1;
+    }
+    return total;
+}
+
+void FileIndex::add(FileData* file)
+{
+    if (m_names.contains(file)) return;
+
+    QString name = file->getFriendlyName().toLower();
+    m_names.insert(file, name);
+
+    QSet<quint64> nameGrams = grams(name);
+    QSet<quint64>::const_iterator it;
+    for (it = nameGrams.constBegin(); it != nameGrams.constEnd(); ++it)
+    {
+        m_grams[*it].insert(file);
+    }
+
+    QStringList nameTokens = tokenize(name);
+    for (int i = 0; i < nameTokens.count(); i++)
+    {
+        m_tokens[nameTokens[i]].insert(file);
+    }
+}
+
+void FileIndex::remove(FileData* file)
+{
+    if (!m_names.contains(file)) return;
+
+    QString name = m_names.take(file);
+
+    QSet<quint64> nameGrams = grams(name);
+    QSet<quint64>::const_iterator it;
+    for (it = nameGrams.constBegin(); it != nameGrams.constEnd(); ++it)
+    {
+        QSet<FileData*>& posting = m_grams[*it];
+        posting.remove(file);
+        if (posting.isEmpty()) m_grams.remove(*it);
+    }
+
+    QStringList nameTokens = tokenize(name);
+    for (int i = 0; i < nameTokens.count(); i++)
+    {
+        QSet<FileData*>& posting = m_tokens[nameTokens[i]];
+        posting.remove(file);
+        if (posting.isEmpty()) m_tokens.remove(nameTokens[i]);
+    }
+}
+
+QSet<FileData*> FileIndex::findTerm(const QString& term)
+{
+    QString lower = term.toLower();
+    if (lower.isEmpty()) return QSet<FileData*>();
+
+    if (lower.size() <= 3)
+    {
+        // every substring this short is indexed, so this is exact
+        return m_grams.value(gramKey(lower, 0, lower.size()));
+    }
+
+    // Find the trigram with the shortest posting list; a match must contain
+    // every trigram of the term
+    QList<const QSet<FileData*>*> postings;
+    const QSet<FileData*>* smallest = NULL;
+    for (int pos = 0; pos + 3 <= lower.size(); pos++)
+    {
+        QHash<quint64, QSet<FileData*> >::const_iterator it =
+            m_grams.constFind(gramKey(lower, pos, 3));
+        if (it == m_grams.constEnd()) return QSet<FileData*>();
+
+        postings.append(&it.value());
+        if (!smallest || it.value().count() < smallest->count())
+        {
+            smallest = &it.value();
+        }
+    }
+
+    // Intersect, then check candidates for the term itself since having all
+    // the trigrams doesn't guarantee they're adjacent
+    QSet<FileData*> result;
+    QSet<FileData*>::const_iterator fileIt;
+    for (fileIt = smallest->constBegin(); fileIt != smallest->constEnd(); ++fileIt)
+    {
+        bool inAll = true;
+        for (int i = 0; i < postings.count() && inAll; i++)
+        {
+            inAll = postings[i] == smallest || postings[i]->contains(*fileIt);
+        }
+        if (inAll && m_names[*fileIt].contains(lower))
+        {
+            result.insert(*fileIt);
+        }
+    }
+    return result;
+}
+
+QList<FileData*> FileIndex::find(const QString& searchTerms)
+{
+    QStringList terms = searchTerms.split(" ", QString::SkipEmptyParts);
+
+    QSet<FileData*> matches;
+    for (int i = 0; i < terms.count(); i++)
+    {
+        matches.unite(findTerm(terms[i]));
+    }
+    return matches.toList();
+}
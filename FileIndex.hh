@@ -0,0 +1,60 @@
+#ifndef FILE_INDEX_HH
+#define FILE_INDEX_HH
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QSet>
+#include <QList>
+
+class FileData;
+
+// Inverted index over the names of shared files. Every substring of up to
+// three characters of a file's name is indexed, so a search term of up to
+// three characters is a single lookup and a longer term is answered by
+// intersecting the posting lists of its trigrams. Matching is
+// case-insensitive.
+class FileIndex
+{
+public:
+    FileIndex() { }
+
+    void add(FileData* file);
+    void remove(FileData* file);
+
+    // Returns the files whose names contain any of the space-separated
+    // search terms
+    QList<FileData*> find(const QString& searchTerms);
+
+    // Returns the files whose names contain term
+    QSet<FileData*> findTerm(const QString& term);
+
+    // Splits a file name into lowercase alphanumeric tokens
+    static QStringList tokenize(const QString& name);
+
+    // Scores how well a file name matches the space-separated search terms.
+    // Higher is better; a term matching a whole token of the name counts for
+    // more than one matching part of a token.
+    static int score(const QString& name, const QString& searchTerms);
+
+    // Returns all distinct name tokens of the indexed files
+    QList<QString> tokens() const { return m_tokens.keys(); }
+
+private:
+    // Packs the n <= 3 characters of str starting at pos into a key
+    static quint64 gramKey(const QString& str, int pos, int n);
+
+    // Returns the distinct gram keys of a lowercase name
+    static QSet<quint64> grams(const QString& name);
+
+    // Posting lists keyed by gram
+    QHash<quint64, QSet<FileData*> > m_grams;
+
+    // Posting lists keyed by name token
+    QHash<QString, QSet<FileData*> > m_tokens;
+
+    // Lowercase name of each indexed file
+    QHash<FileData*, QString> m_names;
+};
+
+#endif // FILE_INDEX_HH
@@ -1,15 +1,38 @@
 #include <QDebug>
 #include <QStringList>
+#include <QtCrypto>
 
 #include "FileStore.hh"
+#include "Dht.hh"
+#include "DownloadScheduler.hh"
+
+// Size of a SHA-256 hash in a blocklist
+#define SHA_SIZE (32)
 
 FileStore* GlobalFiles;
 
 bool FileStore::addSharingFile(QString& fileName)
 {
     FileData* newFile = new FileData(fileName);
+    if (!newFile->m_isSharing)
+    {
+        // the file couldn't be read
+        delete newFile;
+        return false;
+    }
+
+    if (m_sharingFiles.contains(newFile->m_fileId))
+    {
+        qDebug() << "Already sharing " << fileName;
+        delete newFile;
+        return false;
+    }
 
     m_sharingFiles.insert(newFile->m_fileId, newFile);
+    indexBlocks(newFile);
+    m_index.add(newFile);
+    m_summary.insertName(newFile->getFriendlyName());
+    GlobalDht->publishFile(newFile);
     return true;
 }
 
@@ -22,81 +45,156 @@ bool FileStore::findBlock(QByteArray& hash, QByteArray& outBlock)
         outBlock = m_sharingFiles[hash]->m_blocklist;
         return true;
     }
+    else if (m_partialFiles.contains(hash))
+    {
+        qDebug() << "    requested blocklist for download " << m_partialFiles[hash]->m_name;
+        outBlock = m_partialFiles[hash]->m_blocklist;
+        return true;
+    }
     else
     {
-        // Check each file to see if it it contains the hash
-        QList<FileData*> files = m_sharingFiles.values();
-        for (int i = 0; i < files.count(); i++)
+        QHash<QByteArray, BlockRef>::const_iterator it = m_blocks.constFind(hash);
+        if (it == m_blocks.constEnd())
         {
-            if (files[i]->containsHash(hash))
-            {
-                qDebug() << "    found file with requested block: " << files[i]->m_name;
-                qint64 blockNo = files[i]->findBlock(hash);
-                if (blockNo == -1)
-                {
-                    qDebug() << "    BUG...File doesn't contain block after all;";
-                    return false;
-                }
-                outBlock = files[i]->m_data[blockNo];
-                return true;
-            }
+            qDebug() << "    requested hash doesn't match any of our blocks";
+            return false;
         }
-        qDebug() << "    requested hash doesn't match any of our blocks";
-        return false;
+
+        qDebug() << "    found file with requested block: " << it.value().m_file->m_name;
+        outBlock = it.value().m_file->m_data[it.value().m_index];
+        return true;
+    }
+}
+
+void FileStore::shareBlocklist(FileData* file)
+{
+    m_partialFiles.insert(file->m_fileId, file);
+}
+
+void FileStore::shareBlock(const QByteArray& hash, FileData* file, int index)
+{
+    if (m_blocks.contains(hash)) return;
+
+    BlockRef ref;
+    ref.m_file = file;
+    ref.m_index = index;
+    m_blocks.insert(hash, ref);
+}
+
+void FileStore::indexBlocks(FileData* file)
+{
+    for (int i = 0; i < file->m_data.count(); i++)
+    {
+        shareBlock(file->m_blocklist.mid(i * SHA_SIZE, SHA_SIZE), file, i);
+    }
+}
+
+void FileStore::unindexBlocks(FileData* file)
+{
+    if (m_partialFiles.value(file->m_fileId) == file) m_partialFiles.remove(file->m_fileId);
+
+    for (int i = 0; i * SHA_SIZE < file->m_blocklist.size(); i++)
+    {
+        QByteArray hash = file->m_blocklist.mid(i * SHA_SIZE, SHA_SIZE);
+        QHash<QByteArray, BlockRef>::iterator it = m_blocks.find(hash);
+        if (it != m_blocks.end() && it.value().m_file == file) m_blocks.erase(it);
     }
 }
 
-void FileStore::addDownloadFile(QString& fileName, QByteArray &fileId, QString& host)
+void FileStore::addDownloadFile(QString& fileName,
+                                QByteArray &fileId,
+                                QString& host,
+                                int priority)
 {
+    // Finished downloads are shared, so we may have the file already
+    if (m_sharingFiles.contains(fileId) || m_downloadingFiles.contains(fileId))
+    {
+        qDebug() << "Already have or downloading " << fileName;
+        return;
+    }
+
     FileData* newFile = new FileData(fileName, fileId, host);
 
     m_downloadingFiles.insert(fileId, newFile);
-    m_downloadingFiles[fileId]->requestBlock();
+    GlobalDownloads->add(newFile, priority);
 }
 
 void FileStore::addBlock(QByteArray &blockHash, QByteArray &data)
 {
-    QList<QByteArray> downIds = m_downloadingFiles.keys();
+    QList<FileData*> files = m_expectedBlocks.values(blockHash);
+    if (files.isEmpty())
+    {
+        qDebug() << "    received a block nobody requested";
+        return;
+    }
 
-    for (int i = 0; i < downIds.count(); i++)
+    // Verify the hash once for every download waiting for it
+    QCA::Hash shaHash("sha256");
+    shaHash.update(data);
+    if (blockHash != shaHash.final().toByteArray())
     {
-        if (m_downloadingFiles[downIds[i]]->containsHash(blockHash))
-        {
-            // Add the block to the file and remove it from pending files
-            // if it's done downloading
-            if(m_downloadingFiles[downIds[i]]->addBlock(blockHash, data))
-            {
-                // TODO reshare completed files?
-                FileData* doneFile = m_downloadingFiles[downIds[i]];
-                m_downloadingFiles.remove(downIds[i]);
-                delete doneFile;
-                return;
-            }
-        }
+        qDebug() << "    BAD HASH RECEIVED";
+        return;
+    }
+
+    for (int i = 0; i < files.count(); i++)
+    {
+        // Add the block to the file and remove it from pending files if
+        // it's done downloading
+        if (files[i]->storeBlock(blockHash, data)) finishDownload(files[i]);
     }
 }
 
+void FileStore::expectBlock(const QByteArray& hash, FileData* file)
+{
+    if (!m_expectedBlocks.contains(hash, file)) m_expectedBlocks.insert(hash, file);
+}
+
+void FileStore::forgetBlock(const QByteArray& hash, FileData* file)
+{
+    m_expectedBlocks.remove(hash, file);
+}
+
+void FileStore::finishDownload(FileData* file)
+{
+    m_downloadingFiles.remove(file->m_fileId);
+    m_partialFiles.remove(file->m_fileId);
+    GlobalDownloads->remove(file);
+
+    if (m_sharingFiles.contains(file->m_fileId))
+    {
+        qDebug() << "Already sharing " << file->m_name;
+        unindexBlocks(file);
+        delete file;
+        return;
+    }
+
+    // Its blocks are indexed already, so other nodes have been getting them
+    // from us while it downloaded. Now it's found by searches too.
+    file->shareDownload();
+    m_sharingFiles.insert(file->m_fileId, file);
+    m_index.add(file);
+    m_summary.insertName(file->getFriendlyName());
+    GlobalDht->publishFile(file);
+    emit sharingFile(file->getFriendlyName());
+}
+
+void FileStore::failDownload(FileData* file)
+{
+    m_downloadingFiles.remove(file->m_fileId);
+    unindexBlocks(file);
+    delete file;
+}
+
 bool FileStore::findFile(QString &searchTerms,
                          QList<QString> &outFileNames,
                          QList<QByteArray> &outFileIds)
 {
-    QStringList terms = searchTerms.split(" ", QString::SkipEmptyParts);
-    bool found = false;
-
-    QList<FileData*> files = m_sharingFiles.values();
+    QList<FileData*> files = m_index.find(searchTerms);
     for (int i = 0; i < files.count(); i++)
     {
-        QString friendlyName = files[i]->getFriendlyName();
-        for (int j = 0; j < terms.count(); j++)
-        {
-            if (friendlyName.contains(terms[j], Qt::CaseInsensitive))
-            {
-                found = true;
-                outFileNames.append(friendlyName);
-                outFileIds.append(files[i]->m_fileId);
-                break;
-            }
-        }
+        outFileNames.append(files[i]->getFriendlyName());
+        outFileIds.append(files[i]->m_fileId);
     }
-    return found;
+    return !files.isEmpty();
 }
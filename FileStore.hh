@@ -4,10 +4,13 @@
 #include <QObject>
 #include <QString>
 #include <QHash>
+#include <QMultiHash>
 #include <QByteArray>
 #include <QList>
 
 #include "FileData.hh"
+#include "FileIndex.hh"
+#include "BloomFilter.hh"
 
 // A store for all FileData objects
 class FileStore : public QObject
@@ -20,7 +23,8 @@ public:
     // Add a file for this node to share
     bool addSharingFile(QString& fileName);
 
-    // Returns the block associated with the given hash.
+    // Returns the block associated with the given hash. Blocks of files
+    // still downloading are found too, once they've been verified.
     bool findBlock(QByteArray& hash, QByteArray& outBlock);
 
     // Searches files being shared by this host for fileNames containing one
@@ -30,23 +34,82 @@ public:
                   QList<QString>& outFileNames,
                   QList<QByteArray>& outFileIds);
 
+    // Returns the files we share
+    QList<FileData*> sharedFiles() { return m_sharingFiles.values(); }
+
+    // Bloom filter summarizing the names of the files we share
+    const BloomFilter& summary() { return m_summary; }
+
+    // Removes a download that completed and shares the file, unless we
+    // share it already
+    void finishDownload(FileData* file);
+
+    // Removes and deletes a download that gave up, so that it can be
+    // started again
+    void failDownload(FileData* file);
+
+    // Makes the blocklist, or a verified block, of a file being downloaded
+    // available to other nodes
+    void shareBlocklist(FileData* file);
+    void shareBlock(const QByteArray& hash, FileData* file, int index);
+
+    // Records that a download requested the block with the given hash, so
+    // replies are dispatched to it. forgetBlock undoes this.
+    void expectBlock(const QByteArray& hash, FileData* file);
+    void forgetBlock(const QByteArray& hash, FileData* file);
+
+signals:
+    // Emitted when a finished download starts being shared
+    void sharingFile(const QString& fileName);
+
 public slots:
-    // Add a file to download
-    void addDownloadFile(QString& fileName, QByteArray& fileId, QString& host);
+    // Add a file to download. Downloads with a higher priority get a larger
+    // share of GlobalDownloads' request budget.
+    void addDownloadFile(QString& fileName,
+                         QByteArray& fileId,
+                         QString& host,
+                         int priority = 1);
 
-    // Adds a block to one of the downloading files. Removes the file from
-    // the store of downloading files if this is the last block. Verifies that
-    // the blockHash is the correct hash of the data before adding the block.
+    // Adds a block to the downloading files that requested it. Removes a
+    // file from the store of downloading files if this is its last block.
+    // Verifies that the blockHash is the correct hash of the data before
+    // adding the block.
     void addBlock(QByteArray& blockHash, QByteArray& data);
 
 private:
+    // A block we can serve
+    struct BlockRef
+    {
+        FileData* m_file;
+        int m_index;
+    };
+
+    // Adds every block of a file we share to m_blocks
+    void indexBlocks(FileData* file);
+
+    // Removes a file's blocks from m_blocks and m_partialFiles
+    void unindexBlocks(FileData* file);
+
     // Contains the FileData for each file being shared on the network.
     // Keyed by the file's ID.
     QHash<QByteArray, FileData*> m_sharingFiles;
 
+    // Index over the names of the files in m_sharingFiles
+    FileIndex m_index;
+    BloomFilter m_summary;
+
     // Contains the FileData for each file being downloaded.
     // Keyed by the file's ID.
     QHash<QByteArray, FileData*> m_downloadingFiles;
+
+    // Downloads waiting for each block, keyed by the block's hash
+    QMultiHash<QByteArray, FileData*> m_expectedBlocks;
+
+    // Every block we can serve, keyed by its hash
+    QHash<QByteArray, BlockRef> m_blocks;
+
+    // Downloads whose blocklists we have, keyed by fileId
+    QHash<QByteArray, FileData*> m_partialFiles;
 };
 
 extern FileStore* GlobalFiles;
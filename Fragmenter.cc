@@ -0,0 +1,287 @@
+#include <stdlib.h>
+
+#include <QDebug>
+#include <QDateTime>
+#include <QDataStream>
+#include <QtEndian>
+
+#include "Fragmenter.hh"
+
+#define FRAGMENT_MAGIC (0xfa570002)
+#define NACK_MAGIC (0xfa570003)
+#define FRAGMENT_HEADER_BYTES (12)
+#define NACK_HEADER_BYTES (8)
+
+// Largest fragment, chosen to fit in a 1500-byte Ethernet frame with the
+// IP and UDP headers to spare
+#define FRAGMENT_BYTES (1400)
+#define FRAGMENT_PAYLOAD (FRAGMENT_BYTES - FRAGMENT_HEADER_BYTES)
+#define MAX_FRAGMENTS (128)
+
+// Fragments of sent messages are kept this many ms for retransmission, up
+// to this many bytes
+#define SENT_TTL (5000)
+#define MAX_SENT_BYTES (4 * 1024 * 1024)
+
+// A message missing fragments is NACKed after this many ms without new
+// ones, up to MAX_NACKS times, and dropped after REASSEMBLY_TIMEOUT ms
+#define NACK_DELAY (200)
+#define MAX_NACKS (5)
+#define REASSEMBLY_TIMEOUT (5000)
+#define MAX_PARTIAL_BYTES (4 * 1024 * 1024)
+#define MAX_NACK_INDICES (256)
+
+// How often kept fragments and completed message IDs are checked for
+// expiry, in ms
+#define EXPIRY_INTERVAL (1000)
+
+Fragmenter::Fragmenter(SendQueue* queue)
+    : m_expiryTimer(this, &Fragmenter::expire)
+{
+    m_queue = queue;
+    m_nextId = rand();
+    m_sentBytes = 0;
+    m_partialBytes = 0;
+}
+
+Fragmenter::~Fragmenter()
+{
+    qDeleteAll(m_partials);
+}
+
+bool Fragmenter::needsFragments(int size)
+{
+    return size > FRAGMENT_BYTES;
+}
+
+bool Fragmenter::isFragment(const QByteArray& datagram)
+{
+    if (datagram.size() < NACK_HEADER_BYTES) return false;
+    quint32 magic = qFromBigEndian<quint32>((const uchar*)datagram.constData());
+    return magic == FRAGMENT_MAGIC || magic == NACK_MAGIC;
+}
+
+int Fragmenter::maxBytes()
+{
+    return FRAGMENT_PAYLOAD * MAX_FRAGMENTS;
+}
+
+void Fragmenter::send(const QByteArray& datagram,
+                      const QHostAddress& address,
+                      quint16 port,
+                      SendQueue::Class cls)
+{
+    int count = (datagram.size() + FRAGMENT_PAYLOAD - 1) / FRAGMENT_PAYLOAD;
+    if (count > MAX_FRAGMENTS)
+    {
+        qDebug() << "Datagram too large to send: " << datagram.size() << " bytes";
+        return;
+    }
+
+    quint32 id = m_nextId++;
+    Sent sent;
+    sent.m_address = address;
+    sent.m_port = port;
+    sent.m_cls = cls;
+    sent.m_sent = QDateTime::currentMSecsSinceEpoch();
+
+    for (int i = 0; i < count; i++)
+    {
+        QByteArray fragment;
+        QDataStream dataStream(&fragment, QIODevice::WriteOnly);
+        dataStream << (quint32)FRAGMENT_MAGIC << id << (quint16)i << (quint16)count;
+        fragment.append(datagram.mid(i * FRAGMENT_PAYLOAD, FRAGMENT_PAYLOAD));
+
+        m_queue->send(fragment, address, port, cls);
+        sent.m_fragments.append(fragment);
+    }
+
+    // Keep the fragments for NACKs, dropping the oldest kept ones to make
+    // room
+    while (!m_sentOrder.isEmpty() && m_sentBytes + datagram.size() > MAX_SENT_BYTES)
+    {
+        Sent old = m_sent.take(m_sentOrder.dequeue());
+        for (int i = 0; i < old.m_fragments.count(); i++)
+        {
+            m_sentBytes -= old.m_fragments[i].size();
+        }
+    }
+    for (int i = 0; i < count; i++) m_sentBytes += sent.m_fragments[i].size();
+    m_sent.insert(id, sent);
+    m_sentOrder.enqueue(id);
+    if (!m_expiryTimer.isActive()) m_expiryTimer.startRepeating(EXPIRY_INTERVAL);
+}
+
+bool Fragmenter::receive(const QByteArray& fragment,
+                         const QHostAddress& address,
+                         quint16 port,
+                         QByteArray& datagramOut)
+{
+    if (qFromBigEndian<quint32>((const uchar*)fragment.constData()) == NACK_MAGIC)
+    {
+        receiveNack(fragment, address, port);
+        return false;
+    }
+    if (fragment.size() < FRAGMENT_HEADER_BYTES) return false;
+
+    const uchar* header = (const uchar*)fragment.constData();
+    quint32 id = qFromBigEndian<quint32>(header + 4);
+    int index = qFromBigEndian<quint16>(header + 8);
+    int count = qFromBigEndian<quint16>(header + 10);
+    if (count < 1 || count > MAX_FRAGMENTS || index >= count
+        || fragment.size() == FRAGMENT_HEADER_BYTES)
+    {
+        return false;
+    }
+
+    MessageKey key = qMakePair(NeighborKey(address, port), id);
+    if (m_completed.contains(key)) return false;
+
+    QHash<MessageKey, Partial*>::iterator it = m_partials.find(key);
+    if (it == m_partials.end())
+    {
+        while (!m_partials.isEmpty()
+               && m_partialBytes + fragment.size() > MAX_PARTIAL_BYTES)
+        {
+            dropOldestPartial();
+        }
+
+        Partial* partial = new Partial(this, key);
+        partial->m_fragments.resize(count);
+        partial->m_received = 0;
+        partial->m_bytes = 0;
+        partial->m_address = address;
+        partial->m_port = port;
+        partial->m_started = QDateTime::currentMSecsSinceEpoch();
+        partial->m_nacks = 0;
+        it = m_partials.insert(key, partial);
+    }
+
+    Partial* partial = it.value();
+    if (count != partial->m_fragments.count() || !partial->m_fragments[index].isNull())
+    {
+        // A duplicate, or a fragment that doesn't agree with the others
+        return false;
+    }
+
+    partial->m_fragments[index] = fragment.mid(FRAGMENT_HEADER_BYTES);
+    partial->m_received++;
+    partial->m_bytes += partial->m_fragments[index].size();
+    m_partialBytes += partial->m_fragments[index].size();
+
+    if (partial->m_received < count)
+    {
+        // NACK if nothing more arrives for a while
+        partial->m_timer.start(NACK_DELAY);
+        return false;
+    }
+
+    datagramOut.clear();
+    datagramOut.reserve(partial->m_bytes);
+    for (int i = 0; i < count; i++) datagramOut.append(partial->m_fragments[i]);
+
+    dropPartial(partial);
+    m_completed.insert(key, QDateTime::currentMSecsSinceEpoch());
+    if (!m_expiryTimer.isActive()) m_expiryTimer.startRepeating(EXPIRY_INTERVAL);
+    return true;
+}
+
+void Fragmenter::receiveNack(const QByteArray& nack, const QHostAddress& address, quint16 port)
+{
+    const uchar* data = (const uchar*)nack.constData();
+    quint32 id = qFromBigEndian<quint32>(data + 4);
+
+    QHash<quint32, Sent>::const_iterator it = m_sent.constFind(id);
+    if (it == m_sent.constEnd()) return;
+
+    // Only the receiver of a message may ask for it again
+    const Sent& sent = it.value();
+    if (!(NeighborKey(sent.m_address, sent.m_port) == NeighborKey(address, port))) return;
+
+    for (int offset = NACK_HEADER_BYTES; offset + 2 <= nack.size(); offset += 2)
+    {
+        int index = qFromBigEndian<quint16>(data + offset);
+        if (index < sent.m_fragments.count())
+        {
+            m_queue->send(sent.m_fragments[index], sent.m_address, sent.m_port, sent.m_cls);
+        }
+    }
+}
+
+void Fragmenter::partialTimedOut(Partial* partial)
+{
+    qint64 age = QDateTime::currentMSecsSinceEpoch() - partial->m_started;
+    if (age >= REASSEMBLY_TIMEOUT)
+    {
+        qDebug() << "Reassembly timed out with " << partial->m_received << " of "
+            << partial->m_fragments.count() << " fragments";
+        dropPartial(partial);
+        return;
+    }
+
+    if (partial->m_nacks < MAX_NACKS)
+    {
+        QByteArray nack;
+        QDataStream dataStream(&nack, QIODevice::WriteOnly);
+        dataStream << (quint32)NACK_MAGIC << partial->m_key.second;
+        int listed = 0;
+        for (int i = 0; i < partial->m_fragments.count() && listed < MAX_NACK_INDICES; i++)
+        {
+            if (partial->m_fragments[i].isNull())
+            {
+                dataStream << (quint16)i;
+                listed++;
+            }
+        }
+
+        m_queue->send(nack, partial->m_address, partial->m_port, SendQueue::Control);
+        partial->m_nacks++;
+    }
+
+    // Wait for the resent fragments, or else for the timeout
+    int left = REASSEMBLY_TIMEOUT - (int)age;
+    partial->m_timer.start(partial->m_nacks < MAX_NACKS ? qMin(NACK_DELAY, left) : left);
+}
+
+void Fragmenter::dropPartial(Partial* partial)
+{
+    m_partialBytes -= partial->m_bytes;
+    m_partials.remove(partial->m_key);
+    delete partial;
+}
+
+void Fragmenter::dropOldestPartial()
+{
+    Partial* oldest = NULL;
+    QHash<MessageKey, Partial*>::iterator it;
+    for (it = m_partials.begin(); it != m_partials.end(); ++it)
+    {
+        if (!oldest || it.value()->m_started < oldest->m_started) oldest = it.value();
+    }
+
+    dropPartial(oldest);
+}
+
+void Fragmenter::expire()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    while (!m_sentOrder.isEmpty()
+           && m_sent.value(m_sentOrder.head()).m_sent < now - SENT_TTL)
+    {
+        Sent old = m_sent.take(m_sentOrder.dequeue());
+        for (int i = 0; i < old.m_fragments.count(); i++)
+        {
+            m_sentBytes -= old.m_fragments[i].size();
+        }
+    }
+
+    QHash<MessageKey, qint64>::iterator done = m_completed.begin();
+    while (done != m_completed.end())
+    {
+        if (done.value() < now - REASSEMBLY_TIMEOUT) done = m_completed.erase(done);
+        else ++done;
+    }
+
+    if (m_sentOrder.isEmpty() && m_completed.isEmpty()) m_expiryTimer.stop();
+}
@@ -0,0 +1,125 @@
+#ifndef FRAGMENTER_HH
+#define FRAGMENTER_HH
+
+#include <QByteArray>
+#include <QHostAddress>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QQueue>
+#include <QVector>
+
+#include "NeighborTable.hh"
+#include "SendQueue.hh"
+#include "TimerWheel.hh"
+
+// Splits datagrams too large for one packet into fragments small enough to
+// avoid IP fragmentation, and reassembles them on arrival. Fragments start
+// with a header of magic (quint32), message ID (quint32), fragment index
+// (quint16) and fragment count (quint16). A receiver missing fragments
+// after a pause sends a NACK listing them: magic (quint32), message ID
+// (quint32), then each missing index (quint16). The sender keeps its
+// fragments for a few seconds to resend them.
+class Fragmenter
+{
+public:
+    Fragmenter(SendQueue* queue);
+    ~Fragmenter();
+
+    // True if a datagram must be fragmented
+    static bool needsFragments(int size);
+
+    // True if datagram is a fragment or a NACK
+    static bool isFragment(const QByteArray& datagram);
+
+    // Largest datagram that can be sent in fragments
+    static int maxBytes();
+
+    // Sends datagram to address:port in fragments of the given class
+    void send(const QByteArray& datagram,
+              const QHostAddress& address,
+              quint16 port,
+              SendQueue::Class cls);
+
+    // Handles a fragment or NACK from address:port. Returns true and sets
+    // datagramOut once a whole datagram has arrived.
+    bool receive(const QByteArray& fragment,
+                 const QHostAddress& address,
+                 quint16 port,
+                 QByteArray& datagramOut);
+
+private:
+    // A message we sent, kept for retransmission
+    struct Sent
+    {
+        QList<QByteArray> m_fragments;
+        QHostAddress m_address;
+        quint16 m_port;
+        SendQueue::Class m_cls;
+        qint64 m_sent;
+    };
+
+    typedef QPair<NeighborKey, quint32> MessageKey;
+
+    // A message being reassembled
+    struct Partial
+    {
+        Partial(Fragmenter* fragmenter, const MessageKey& key)
+            : m_fragmenter(fragmenter), m_key(key),
+              m_timer(this, &Partial::timedOut) { }
+
+        void timedOut() { m_fragmenter->partialTimedOut(this); }
+
+        Fragmenter* m_fragmenter;
+        MessageKey m_key;
+        QVector<QByteArray> m_fragments;
+        int m_received;
+        int m_bytes;
+        QHostAddress m_address;
+        quint16 m_port;
+
+        // Time reassembly started, in ms since the epoch
+        qint64 m_started;
+        int m_nacks;
+
+        // Fires NACK_DELAY ms after the last fragment or NACK, and when
+        // reassembly times out
+        MemberTimer<Partial> m_timer;
+    };
+
+    // Resends the fragments a NACK asks for
+    void receiveNack(const QByteArray& nack, const QHostAddress& address, quint16 port);
+
+    // NACKs the fragments a stalled message is missing, or drops it once
+    // reassembly times out
+    void partialTimedOut(Partial* partial);
+
+    // Removes and deletes a partial message
+    void dropPartial(Partial* partial);
+
+    // Drops the oldest partial message
+    void dropOldestPartial();
+
+    // Drops kept fragments and completed message IDs once they expire
+    void expire();
+
+    SendQueue* m_queue;
+    quint32 m_nextId;
+
+    QHash<quint32, Sent> m_sent;
+    QQueue<quint32> m_sentOrder;
+    int m_sentBytes;
+
+    QHash<MessageKey, Partial*> m_partials;
+    int m_partialBytes;
+
+    // Messages reassembled recently, so late retransmissions of their
+    // fragments are ignored. Values are completion times.
+    QHash<MessageKey, qint64> m_completed;
+
+    // Expiry is coarse, so one timer sweeps m_sent and m_completed while
+    // they hold anything
+    MemberTimer<Fragmenter> m_expiryTimer;
+};
+
+#endif // FRAGMENTER_HH
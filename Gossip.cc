@@ -0,0 +1,71 @@
+#include <stdlib.h>
+
+#include <QDebug>
+
+#include "Gossip.hh"
+
+// Status intervals in ms when we're relying on pushes and on pulls
+#define PUSH_STATUS_INTERVAL (10000)
+#define PULL_STATUS_INTERVAL (2000)
+
+// Number of rumors whose push counts are remembered
+#define MAX_TRACKED_RUMORS (4096)
+
+GossipPolicy* GlobalGossip;
+
+GossipPolicy::GossipPolicy()
+{
+    m_mode = Push;
+    m_fanout = 1;
+    m_stopProb = 0.5;
+    m_maxPushes = 0;
+}
+
+bool GossipPolicy::setMode(const QString& mode)
+{
+    if (mode == "push") m_mode = Push;
+    else if (mode == "pull") m_mode = Pull;
+    else if (mode == "pushpull") m_mode = PushPull;
+    else
+    {
+        qDebug() << "Unknown gossip mode: " << mode;
+        return false;
+    }
+    return true;
+}
+
+int GossipPolicy::statusInterval()
+{
+    return pulls() ? PULL_STATUS_INTERVAL : PUSH_STATUS_INTERVAL;
+}
+
+void GossipPolicy::recordPush(const MessageInfo& mesInf)
+{
+    if (m_maxPushes <= 0) return;
+
+    QPair<int, int> key = qMakePair(mesInf.m_originId, mesInf.m_seqNo);
+    QHash<QPair<int, int>, int>::iterator it = m_pushes.find(key);
+    if (it != m_pushes.end())
+    {
+        it.value()++;
+        return;
+    }
+
+    m_pushes.insert(key, 1);
+    m_pushOrder.enqueue(key);
+    if (m_pushOrder.count() > MAX_TRACKED_RUMORS)
+    {
+        m_pushes.remove(m_pushOrder.dequeue());
+    }
+}
+
+bool GossipPolicy::keepMongering(const MessageInfo& mesInf)
+{
+    if (m_maxPushes > 0
+        && m_pushes.value(qMakePair(mesInf.m_originId, mesInf.m_seqNo), 0) >= m_maxPushes)
+    {
+        return false;
+    }
+
+    return rand() >= m_stopProb * ((double)RAND_MAX + 1.0);
+}
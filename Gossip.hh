@@ -0,0 +1,73 @@
+#ifndef GOSSIP_HH
+#define GOSSIP_HH
+
+#include <QString>
+#include <QHash>
+#include <QQueue>
+#include <QPair>
+
+#include "messageinfo.hh"
+
+// Parameters of the epidemic protocol used to spread rumors, and the
+// per-rumor state needed to decide when to stop spreading them.
+class GossipPolicy
+{
+public:
+    GossipPolicy();
+
+    enum Mode
+    {
+        // New rumors are pushed to random neighbors
+        Push = 0,
+        // New rumors aren't pushed; neighbors are frequently sent our status
+        // so they send us what we're missing
+        Pull,
+        // Both of the above
+        PushPull
+    };
+
+    // Sets the mode from "push", "pull" or "pushpull". Returns false if the
+    // string isn't one of these.
+    bool setMode(const QString& mode);
+    void setFanout(int fanout) { m_fanout = qMax(1, fanout); }
+    void setStopProb(double stopProb) { m_stopProb = qBound(0.0, stopProb, 1.0); }
+    void setMaxPushes(int maxPushes) { m_maxPushes = maxPushes; }
+
+    Mode mode() { return m_mode; }
+    bool pushes() { return m_mode != Pull; }
+    bool pulls() { return m_mode != Push; }
+
+    // Number of neighbors a new rumor is pushed to, and number of neighbors
+    // our status is sent to on each pull
+    int fanout() { return m_fanout; }
+
+    // Interval at which status messages are sent to random neighbors, in ms
+    int statusInterval();
+
+    // Records that the rumor was pushed to a neighbor
+    void recordPush(const MessageInfo& mesInf);
+
+    // Called when a push of the rumor wasn't useful, i.e. the neighbor timed
+    // out or already had everything. Returns true if we should keep pushing
+    // it to other neighbors.
+    bool keepMongering(const MessageInfo& mesInf);
+
+private:
+    Mode m_mode;
+    int m_fanout;
+
+    // Probability of giving up on a rumor each time a push isn't useful
+    double m_stopProb;
+
+    // If positive, a rumor is pushed at most this many times by this node
+    int m_maxPushes;
+
+    // Number of pushes per rumor, keyed by origin ID and seqNo. Only the most
+    // recently pushed rumors are tracked, oldest first in m_pushOrder.
+    QHash<QPair<int, int>, int> m_pushes;
+    QQueue<QPair<int, int> > m_pushOrder;
+};
+
+extern GossipPolicy* GlobalGossip;
+
+#endif // GOSSIP_HH
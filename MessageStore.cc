@@ -1,31 +1,50 @@
 #include <QDebug>
+#include <QDataStream>
+#include <QDateTime>
 
 #include "MessageStore.hh"
 
+// Approximate fixed cost of a stored message beyond its body and sig
+#define MESSAGE_OVERHEAD (64)
+
+// How often messages are checked for age-based eviction, in ms
+#define RETENTION_INTERVAL (5000)
+
+// Most messages indexed in the cold store. The oldest are forgotten beyond it.
+#define MAX_COLD_MESSAGES (1 << 20)
+
 MessageStore* GlobalMessages;
 
+MessageStore::MessageStore()
+    : m_retentionTimer(this, &MessageStore::enforceRetention)
+{
+    m_numOrigins = 0;
+    m_count = 0;
+    m_bytes = 0;
+    m_maxAge = 0;
+    m_maxCount = 0;
+    m_maxBytes = 0;
+
+    m_retentionTimer.startRepeating(RETENTION_INTERVAL);
+}
+
+MessageStore::OriginHistory& MessageStore::history(int originId)
+{
+    if (originId >= m_origins.count()) m_origins.resize(originId + 1);
+    return m_origins[originId];
+}
+
 QVariantMap* MessageStore::getStatus()
 {
     QVariantMap* pStatus = new QVariantMap();
 
-    QList<QString> hosts = m_messages.keys();
-    for (int i = 0; i < hosts.count(); i++)
+    for (int id = 0; id < m_origins.count(); id++)
     {
-        QMap<int, MessageInfo> hostMap = m_messages[hosts[i]];
-        QList<int> mesNums = hostMap.keys();
-
-        // figure out the first seqno for this host that we need
-        int firstNeed = 1;
-        for (int j = 0; j < mesNums.count(); j++)
+        int watermark = m_origins[id].m_watermark;
+        if (watermark > 0)
         {
-            if (mesNums[j] == firstNeed)
-            {
-                firstNeed++;
-            }
+            pStatus->insert(GlobalOrigins->name(id), QVariant(watermark));
         }
-        QVariant firstNeedVariant(firstNeed);
-        
-        pStatus->insert(hosts[i], firstNeedVariant);
     }
 
     return pStatus;
@@ -33,49 +52,34 @@ QVariantMap* MessageStore::getStatus()
 
 int MessageStore::getStatusDiff(QVariantMap& remoteStatus, MessageInfo& mesInfOut)
 {
-    QVariantMap* pStatus = getStatus();
-    QVariantMap status(*pStatus);
-    delete pStatus;
-
     // True if the remote host has messages that we don't have.
     bool remoteHasExtra = false;
 
-    QList<QString> hosts = status.keys();
-    for (int i = 0; i < hosts.count(); i++)
+    for (int id = 0; id < m_origins.count(); id++)
     {
-        QString hostName = hosts[i];
-
-        // true if the neighbor doesn't have any messages from this host
-        bool remoteMissing = !remoteStatus.contains(hostName);
-
-        // the first seqno that the neighbor needs from this host
-        int remoteNeed = remoteMissing ? 1 : remoteStatus[hostName].toInt();
-
         // the first seqno that we need from this host
-        int localNeed = status[hostName].toInt();
+        int localNeed = m_origins[id].m_watermark;
+        if (localNeed == 0) continue;
+
+        // the first seqno that the neighbor needs from this host, or 1 if the
+        // neighbor doesn't have any messages from this host
+        QVariantMap::const_iterator remoteIt =
+            remoteStatus.constFind(GlobalOrigins->name(id));
+        int remoteNeed = (remoteIt == remoteStatus.constEnd())
+            ? 1 : remoteIt.value().toInt();
 
-        if (remoteMissing || remoteNeed < localNeed)
+        if (remoteNeed < localNeed)
         {
             // we have messages from a host that they don't!
-            mesInfOut.m_host = hostName;
-
-            QList<int> seqNos = m_messages[hostName].keys();
-            QList<MessageInfo> messes = m_messages[hostName].values();
-            for (int j = 0; j < seqNos.count(); j++)
+            if (findMessage(id, remoteNeed, mesInfOut))
             {
-                if (remoteMissing || seqNos[j] == remoteNeed)
-                {
-                    mesInfOut.m_seqNo = messes[j].m_seqNo;
-                    mesInfOut.m_isRoute = messes[j].m_isRoute;
-                    if (!messes[j].m_isRoute) mesInfOut.m_body = messes[j].m_body;
-                    return 1;
-                }
+                return 1;
             }
 
-            // We determined based on statuses that we have messages that the
-            // neighbor doesn't have, but we were unable to find one such
-            // specific message.
-            qDebug() << "Our status is constructed incorrectly!";
+            // The message they need has been evicted without a cold store,
+            // so we can't help them with this host.
+            qDebug() << "Neighbor needs evicted message. Host: "
+                << GlobalOrigins->name(id) << ", seqno: " << remoteNeed;
         }
         else if (remoteNeed > localNeed)
         {
@@ -83,7 +87,7 @@ int MessageStore::getStatusDiff(QVariantMap& remoteStatus, MessageInfo& mesInfOu
         }
     }
 
-    if (remoteHasExtra || remoteStatus.count() > status.count())
+    if (remoteHasExtra || remoteStatus.count() > m_numOrigins)
     {
         return -1;
     }
@@ -93,50 +97,203 @@ int MessageStore::getStatusDiff(QVariantMap& remoteStatus, MessageInfo& mesInfOu
     }
 }
 
+bool MessageStore::isSeen(int originId, int num)
+{
+    if (originId >= m_origins.count()) return false;
+
+    const OriginHistory& hist = m_origins[originId];
+    return num < hist.m_watermark || hist.m_messages.contains(num);
+}
+
+bool MessageStore::findMessage(int originId, int num, MessageInfo& mesInfOut)
+{
+    if (originId >= m_origins.count()) return false;
+
+    const QMap<int, MessageInfo>& messages = m_origins[originId].m_messages;
+    QMap<int, MessageInfo>::const_iterator it = messages.constFind(num);
+    if (it != messages.constEnd())
+    {
+        mesInfOut = it.value();
+        return true;
+    }
+
+    return readCold(originId, num, mesInfOut);
+}
+
 bool MessageStore::recordMessage(MessageInfo& mesInf, AddrInfo& addr, bool isDirect)
 {
-    QString& hostName = mesInf.m_host;
+    int originId = mesInf.m_originId;
     int num = mesInf.m_seqNo;
 
-    if (m_messages.contains(hostName))
+    if (isSeen(originId, num)) return false;
+
+    OriginHistory& hist = history(originId);
+    bool newHost = hist.m_watermark == 0;
+    if (newHost)
     {
-        if (!m_messages[hostName].contains(num))
-        {
-            m_messages[hostName].insert(num, mesInf);
-            emit newMessage(mesInf, addr, isDirect);
+        hist.m_watermark = 1;
+        m_numOrigins++;
+    }
 
-            if (mesInf.m_isRoute)
-            {
-                qDebug() << "Got new route message. Host: " << hostName
-                    << ", seqno: " << num;
-            }
-            else
-            {
-                qDebug() << "Got new message. Host: " << hostName
-                    << ", seqno: " << num;
-            }
-            return true;
-        }
+    mesInf.m_recvTime = QDateTime::currentMSecsSinceEpoch();
+    hist.m_messages.insert(num, mesInf);
+    m_order.enqueue(qMakePair(originId, num));
+    m_count++;
+    m_bytes += messageBytes(mesInf);
+
+    // advance the watermark past any messages that are now contiguous
+    while (hist.m_messages.contains(hist.m_watermark)) hist.m_watermark++;
+
+    emit newMessage(mesInf, addr, isDirect);
+
+    if (mesInf.m_isRoute)
+    {
+        qDebug() << (newHost ? "Got new route message (new host). Host: "
+                             : "Got new route message. Host: ")
+            << mesInf.host() << ", seqno: " << num;
     }
     else
     {
-        QMap<int, MessageInfo> newHostMap;
-        newHostMap.insert(num, mesInf);
-        m_messages.insert(hostName, newHostMap);
-        emit newMessage(mesInf, addr, isDirect);
+        qDebug() << (newHost ? "Got new message (new host). Host: "
+                             : "Got new message. Host: ")
+            << mesInf.host() << ", seqno: " << num;
+    }
 
-        if (mesInf.m_isRoute)
-        {
-            qDebug() << "Got new route message (new host). Host: " << hostName
-                << ", seqno: " << num;
-        }
-        else
+    enforceRetention();
+    return true;
+}
+
+bool MessageStore::setColdStore(const QString& fileName)
+{
+    if (m_coldFile.isOpen()) m_coldFile.close();
+    for (int id = 0; id < m_origins.count(); id++)
+    {
+        m_origins[id].m_coldIndex.clear();
+    }
+    m_coldOrder.clear();
+
+    m_coldFile.setFileName(fileName);
+    if (!m_coldFile.open(QIODevice::ReadWrite | QIODevice::Truncate))
+    {
+        qDebug() << "ERROR opening cold message store: " << fileName;
+        qDebug() << m_coldFile.errorString();
+        return false;
+    }
+    qDebug() << "Using cold message store: " << fileName;
+    return true;
+}
+
+void MessageStore::enforceRetention()
+{
+    qint64 oldest = QDateTime::currentMSecsSinceEpoch() - (qint64)m_maxAge * 1000;
+
+    while (!m_order.isEmpty())
+    {
+        bool overCount = m_maxCount > 0 && m_count > m_maxCount;
+        bool overBytes = m_maxBytes > 0 && m_bytes > m_maxBytes;
+        bool overAge = false;
+        if (m_maxAge > 0)
         {
-            qDebug() << "Got new message (new host). Host: " << hostName
-                << ", seqno: " << num;
+            const QPair<int, int>& head = m_order.head();
+            overAge = m_origins[head.first].m_messages[head.second].m_recvTime < oldest;
         }
-        return true;
+
+        if (!overCount && !overBytes && !overAge) break;
+
+        evictOldest();
+    }
+}
+
+void MessageStore::evictOldest()
+{
+    QPair<int, int> head = m_order.dequeue();
+    OriginHistory& hist = m_origins[head.first];
+
+    // Only messages below the watermark are covered by it, so evicting a
+    // message beyond a gap moves the watermark past it. The messages missing
+    // in the gap are older than anything we keep, and are given up on.
+    if (head.second >= hist.m_watermark)
+    {
+        qDebug() << "Evicting past a gap. Host: "
+            << GlobalOrigins->name(head.first) << ", seqnos "
+            << hist.m_watermark << " to " << head.second;
+        hist.m_watermark = head.second + 1;
+        while (hist.m_messages.contains(hist.m_watermark)) hist.m_watermark++;
+    }
+
+    MessageInfo mesInf = hist.m_messages.take(head.second);
+    m_count--;
+    m_bytes -= messageBytes(mesInf);
+
+    if (m_coldFile.isOpen()) writeCold(mesInf);
+}
+
+bool MessageStore::writeCold(const MessageInfo& mesInf)
+{
+    qint64 offset = m_coldFile.size();
+    if (!m_coldFile.seek(offset)) return false;
+
+    QDataStream dataStream(&m_coldFile);
+    dataStream << (qint32)mesInf.m_seqNo << mesInf.m_isRoute
+               << mesInf.m_body << mesInf.m_hasSig << mesInf.m_goodSig
+               << mesInf.m_sig << mesInf.m_hasLastRoute;
+    if (mesInf.m_hasLastRoute)
+    {
+        dataStream << mesInf.m_lastIP << mesInf.m_lastPort;
+    }
+
+    if (dataStream.status() != QDataStream::Ok)
+    {
+        qDebug() << "ERROR writing cold message store";
+        return false;
+    }
+
+    m_origins[mesInf.m_originId].m_coldIndex.insert(mesInf.m_seqNo, offset);
+    m_coldOrder.enqueue(qMakePair(mesInf.m_originId, mesInf.m_seqNo));
+
+    // Forget the oldest cold messages; their space in the file isn't reused
+    while (m_coldOrder.count() > MAX_COLD_MESSAGES)
+    {
+        QPair<int, int> oldest = m_coldOrder.dequeue();
+        m_origins[oldest.first].m_coldIndex.remove(oldest.second);
+    }
+    return true;
+}
+
+bool MessageStore::readCold(int originId, int num, MessageInfo& mesInfOut)
+{
+    if (!m_coldFile.isOpen()) return false;
+
+    const QHash<int, qint64>& coldIndex = m_origins[originId].m_coldIndex;
+    QHash<int, qint64>::const_iterator it = coldIndex.constFind(num);
+    if (it == coldIndex.constEnd() || !m_coldFile.seek(it.value()))
+    {
+        return false;
+    }
+
+    QDataStream dataStream(&m_coldFile);
+    qint32 seqNo;
+    dataStream >> seqNo >> mesInfOut.m_isRoute
+               >> mesInfOut.m_body >> mesInfOut.m_hasSig >> mesInfOut.m_goodSig
+               >> mesInfOut.m_sig >> mesInfOut.m_hasLastRoute;
+    if (mesInfOut.m_hasLastRoute)
+    {
+        dataStream >> mesInfOut.m_lastIP >> mesInfOut.m_lastPort;
+    }
+    mesInfOut.m_seqNo = seqNo;
+    mesInfOut.m_originId = originId;
+
+    if (dataStream.status() != QDataStream::Ok)
+    {
+        qDebug() << "ERROR reading cold message store";
+        return false;
     }
+    return true;
+}
 
-    return false;
+qint64 MessageStore::messageBytes(const MessageInfo& mesInf)
+{
+    return MESSAGE_OVERHEAD
+        + mesInf.m_body.size() * sizeof(QChar)
+        + mesInf.m_sig.size();
 }
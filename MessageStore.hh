@@ -4,16 +4,22 @@
 #include <QObject>
 #include <QString>
 #include <QVariantMap>
+#include <QHash>
+#include <QVector>
+#include <QQueue>
+#include <QPair>
+#include <QFile>
 
 #include "messageinfo.hh"
 #include "addrinfo.hh"
+#include "TimerWheel.hh"
 
 class MessageStore : public QObject
 {
     Q_OBJECT
 
 public:
-    MessageStore() {}
+    MessageStore();
 
     // Returns the status of this instance. Status is encoded as a
     // QVariantMap keyed by host name. The value is the lowest message number
@@ -35,15 +41,91 @@ public:
     // Returns true if the message is new, false if not.
     bool recordMessage(MessageInfo& mesInf, AddrInfo& addr, bool isDirect);
 
+    // Retention limits for the gossip history. A limit of 0 means unlimited.
+    // Messages beyond a limit are moved to the cold store if one is set, and
+    // are otherwise dropped, oldest first. Either way the status watermark
+    // still reports them as seen. Evicting a message past a gap in an
+    // origin's sequence gives up on the messages missing in the gap.
+    void setMaxAge(int secs) { m_maxAge = secs; }
+    void setMaxCount(int count) { m_maxCount = count; }
+    void setMaxBytes(qint64 bytes) { m_maxBytes = bytes; }
+
+    // Opens a file in which evicted messages are kept so they can still be
+    // served to neighbors. Returns false if the file cannot be opened.
+    bool setColdStore(const QString& fileName);
+
 signals:
     // Indicates that a new message has been seen for the first time. mesInf
     // is that message, which arrived from addr.
     void newMessage(MessageInfo& mesInf, AddrInfo& addr, bool isDirect);
 
+public slots:
+    // Evicts messages until the store is within its retention limits
+    void enforceRetention();
+
 private:
-    // Map keyed by host names.
-    // The value QMaps are keyed by message number.
-    QMap<QString, QMap<int, MessageInfo> > m_messages;
+    // Gossip history for a single ORIGIN
+    struct OriginHistory
+    {
+        OriginHistory() : m_watermark(0) { }
+
+        // The lowest message number NOT YET seen from this origin; every
+        // message below it has been seen, even if it has since been evicted
+        // (tombstoned). 0 if we've never seen a message from this origin.
+        int m_watermark;
+
+        // Resident messages, keyed by message number
+        QMap<int, MessageInfo> m_messages;
+
+        // Evicted messages, keyed by message number. The values are offsets
+        // into m_coldFile.
+        QHash<int, qint64> m_coldIndex;
+    };
+
+    // Returns the history for the given origin ID, growing m_origins if needed
+    OriginHistory& history(int originId);
+
+    // True if we've already seen message num from the origin, whether or not
+    // we still hold it
+    bool isSeen(int originId, int num);
+
+    // Finds message num from the origin in memory or in the cold store.
+    // Returns false if it has been evicted without a cold store.
+    bool findMessage(int originId, int num, MessageInfo& mesInfOut);
+
+    void evictOldest();
+    bool writeCold(const MessageInfo& mesInf);
+    bool readCold(int originId, int num, MessageInfo& mesInfOut);
+
+    // Approximate resident size of a stored message
+    static qint64 messageBytes(const MessageInfo& mesInf);
+
+    // Indexed by origin ID
+    QVector<OriginHistory> m_origins;
+
+    // Number of origins we've seen messages from
+    int m_numOrigins;
+
+    // Resident messages in the order they were recorded, oldest first.
+    // Contains pairs of origin ID and message number.
+    QQueue<QPair<int, int> > m_order;
+
+    int m_count;
+    qint64 m_bytes;
+
+    int m_maxAge;
+    int m_maxCount;
+    qint64 m_maxBytes;
+
+    // Holds evicted messages if a cold store is set
+    QFile m_coldFile;
+
+    // Messages in the cold store in the order they were evicted, as pairs
+    // of origin ID and message number. Bounds the cold indices.
+    QQueue<QPair<int, int> > m_coldOrder;
+
+    // timer for evicting messages by age
+    MemberTimer<MessageStore> m_retentionTimer;
 };
 
 extern MessageStore* GlobalMessages;
@@ -1,41 +1,80 @@
 #include <QDebug>
+#include <QDateTime>
 
 #include "Monger.hh"
 #include "NetSocket.hh"
 #include "MessageStore.hh"
+#include "Gossip.hh"
+#include "RouteTable.hh"
+
+// ms to wait for a status reply to a rumor before giving up on the neighbor
+#define RUMOR_TIMEOUT (2000)
 
 Monger::Monger()
+    : m_timer(this, &Monger::timeout)
 {
-    setupTimer();
+    init();
 }
 
 Monger::Monger(AddrInfo addrInfo)
+    : m_timer(this, &Monger::timeout)
 {
     m_addrInfo = addrInfo;
-    setupTimer();
+    init();
 }
 
-void Monger::setupTimer()
+void Monger::init()
 {
-    m_pTimer = new QTimer(this);
-    m_pTimer->setSingleShot(true);
-    m_pTimer->setInterval(2000);
-    connect(m_pTimer, SIGNAL(timeout()), this, SLOT(timeout()));
+    m_isStatic = false;
+    m_index = -1;
+    m_lastHeard = QDateTime::currentMSecsSinceEpoch();
+    m_probes = 0;
+    m_answersProbes = false;
+    m_failed = false;
+    m_packetsIn = m_bytesIn = 0;
+    m_packetsOut = m_bytesOut = 0;
 }
 
 void Monger::startTimer()
 {
-    m_pTimer->start();
+    m_timer.start(RUMOR_TIMEOUT);
+}
+
+void Monger::heard(int bytes)
+{
+    m_lastHeard = QDateTime::currentMSecsSinceEpoch();
+    m_probes = 0;
+    if (m_failed)
+    {
+        qDebug() << "Neighbor recovered " << m_addrInfo.m_addr.toString() << ":"
+            << m_addrInfo.m_port;
+        m_failed = false;
+    }
+    m_packetsIn++;
+    m_bytesIn += bytes;
+}
+
+void Monger::sent(int bytes)
+{
+    m_packetsOut++;
+    m_bytesOut += bytes;
 }
 
 void Monger::timeout()
 {
     qDebug() << "Timeout";
-    int resend = rand() % 2;
-    if (resend
-        && (GlobalSocket->m_forward || m_lastSent.m_isRoute))
+    if (m_lastSent.m_originId < 0) return;
+
+    // Clear the rumor before pushing it on, since the push may pick this
+    // neighbor again and set m_lastSent anew
+    MessageInfo lastSent = m_lastSent;
+    m_lastSent = MessageInfo();
+    if (GlobalSocket->m_forward || lastSent.m_isRoute)
     {
-        GlobalSocket->sendToRandNeighbor(m_lastSent);
+        if (GlobalGossip->keepMongering(lastSent))
+        {
+            GlobalSocket->sendToRandNeighbor(lastSent);
+        }
     }
 }
 
@@ -44,11 +83,17 @@ void Monger::receiveMessage(MessageInfo mesInf, AddrInfo& addrInfo, bool isDirec
     if (GlobalMessages->recordMessage(mesInf, addrInfo, isDirect))
     {
         // this is a new rumor
-        if (GlobalSocket->m_forward || mesInf.m_isRoute)
+        if ((GlobalSocket->m_forward || mesInf.m_isRoute)
+            && (GlobalGossip->pushes() || mesInf.m_isRoute))
         {
-            GlobalSocket->sendToRandNeighbor(mesInf);
+            GlobalSocket->sendToRandNeighbor(mesInf, GlobalGossip->fanout());
         }
     }
+    else if (mesInf.m_originId != GlobalSocket->m_hostId)
+    {
+        // A rumor we've seen still tells us of another path to its origin
+        GlobalRoutes->addRoute(mesInf, addrInfo, isDirect);
+    }
 
     // now reply with status
     GlobalSocket->sendStatus(m_addrInfo.m_addr, m_addrInfo.m_port);
@@ -57,7 +102,7 @@ void Monger::receiveMessage(MessageInfo mesInf, AddrInfo& addrInfo, bool isDirec
 void Monger::receiveStatus(QVariantMap remoteStatus)
 {
     MessageInfo mesInf;
-    m_pTimer->stop();
+    m_timer.stop();
 
     int statusDiff = GlobalMessages->getStatusDiff(remoteStatus, mesInf);
 
@@ -76,11 +121,15 @@ void Monger::receiveStatus(QVariantMap remoteStatus)
     }
     else // statusDiff == 0
     {
-        // we have the same set of messages
-        int resend = rand() % 2;
-        if (resend)
+        // we have the same set of messages, so the last rumor we pushed here
+        // wasn't news. Decide whether to keep spreading it elsewhere.
+        MessageInfo lastSent = m_lastSent;
+        m_lastSent = MessageInfo();
+        if (lastSent.m_originId >= 0
+            && (GlobalSocket->m_forward || lastSent.m_isRoute)
+            && GlobalGossip->keepMongering(lastSent))
         {
-            GlobalSocket->sendStatusToRandNeighbor();
+            GlobalSocket->sendToRandNeighbor(lastSent);
         }
     }
 }
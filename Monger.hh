@@ -1,20 +1,18 @@
 #ifndef MONGER_HH
 #define MONGER_HH
 
-#include <QObject>
 #include <QString>
 #include <QVariantMap>
 #include <QHostAddress>
-#include <QTimer>
 
 #include "messageinfo.hh"
 #include "addrinfo.hh"
+#include "TimerWheel.hh"
+#include "BloomFilter.hh"
 
 // Contains the per-neighbor state
-class Monger : public QObject
+class Monger
 {
-    Q_OBJECT
-
 public:
     Monger();
     Monger(AddrInfo addrInfo);
@@ -27,16 +25,53 @@ public:
 
     AddrInfo m_addrInfo;
 
+    // Records a datagram of the given size received from this neighbor
+    void heard(int bytes);
+
+    // Records a datagram of the given size sent to this neighbor
+    void sent(int bytes);
+
+    // True if the user added this neighbor; false if it was added because it
+    // sent us a message. Only neighbors that aren't static are evicted for
+    // being silent.
+    bool m_isStatic;
+
+    // Index of this neighbor in the NeighborTable
+    int m_index;
+
+    // Time we last received a datagram from this neighbor, in ms since the
+    // epoch. Starts as the time the neighbor was added.
+    qint64 m_lastHeard;
+
+    // Liveness probes sent since we last heard from this neighbor
+    int m_probes;
+
+    // True once the neighbor has answered a probe. Older peersters don't,
+    // so their silence alone doesn't mean they failed.
+    bool m_answersProbes;
+
+    // True if the neighbor stopped answering; cleared once we hear from it
+    bool m_failed;
+
+    quint64 m_packetsIn, m_bytesIn;
+    quint64 m_packetsOut, m_bytesOut;
+
+    // Summaries of the file names shared by this neighbor, and by the
+    // neighbor's own neighbors. Empty until the neighbor sends them.
+    BloomFilter m_bloom;
+    BloomFilter m_bloomNear;
+
     // last message sent to this peer; resent to a random neighbor if this
     // neighbor times out
     MessageInfo m_lastSent;
 
-public slots:
     void timeout();
 
 private:
-    void setupTimer();
-    QTimer* m_pTimer;
+    void init();
+
+    // Rumor resend timeout
+    MemberTimer<Monger> m_timer;
 };
 
 #endif // MONGER_HH
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+
+#include <QDebug>
+
+#include "NeighborTable.hh"
+#include "Monger.hh"
+
+NeighborKey::NeighborKey(const QHostAddress& addr, quint16 port)
+{
+    m_port = port;
+    if (addr.protocol() == QAbstractSocket::IPv6Protocol)
+    {
+        Q_IPV6ADDR ip6 = addr.toIPv6Address();
+        for (int i = 0; i < 4; i++)
+        {
+            m_words[i] = ((quint32)ip6[4*i] << 24) | ((quint32)ip6[4*i + 1] << 16)
+                | ((quint32)ip6[4*i + 2] << 8) | (quint32)ip6[4*i + 3];
+        }
+    }
+    else
+    {
+        m_words[0] = 0;
+        m_words[1] = 0;
+        m_words[2] = 0xffff;
+        m_words[3] = addr.toIPv4Address();
+    }
+}
+
+NeighborTable::~NeighborTable()
+{
+    qDeleteAll(m_list);
+}
+
+Monger* NeighborTable::find(const AddrInfo& addr) const
+{
+    return m_index.value(NeighborKey(addr.m_addr, addr.m_port), NULL);
+}
+
+Monger* NeighborTable::add(const AddrInfo& addr, bool isStatic)
+{
+    NeighborKey key(addr.m_addr, addr.m_port);
+    Monger* neighbor = m_index.value(key, NULL);
+    if (neighbor)
+    {
+        // a neighbor the user asked for explicitly stays, even if it was
+        // first added automatically
+        if (isStatic && !neighbor->m_isStatic)
+        {
+            neighbor->m_isStatic = true;
+            m_numAuto--;
+        }
+        return neighbor;
+    }
+
+    neighbor = new Monger(addr);
+    neighbor->m_isStatic = isStatic;
+    if (!isStatic) m_numAuto++;
+    neighbor->m_index = m_list.count();
+    m_list.append(neighbor);
+    m_index.insert(key, neighbor);
+    return neighbor;
+}
+
+void NeighborTable::remove(Monger* neighbor)
+{
+    m_index.remove(NeighborKey(neighbor->m_addrInfo.m_addr,
+                               neighbor->m_addrInfo.m_port));
+
+    // swap the last neighbor into the removed one's slot
+    int i = neighbor->m_index;
+    Monger* last = m_list.last();
+    m_list[i] = last;
+    last->m_index = i;
+    m_list.removeLast();
+
+    if (!neighbor->m_isStatic) m_numAuto--;
+    delete neighbor;
+}
+
+Monger* NeighborTable::random() const
+{
+    if (m_list.isEmpty()) return NULL;
+    return m_list[rand() % m_list.count()];
+}
+
+QList<Monger*> NeighborTable::random(int k) const
+{
+    QList<Monger*> picked;
+    if (k >= m_list.count())
+    {
+        picked = m_list.toList();
+        return picked;
+    }
+
+    // k is normally much smaller than the number of neighbors, so rejection
+    // sampling takes O(k) expected time
+    QSet<int> pickedIndices;
+    while (picked.count() < k)
+    {
+        int i = rand() % m_list.count();
+        if (!pickedIndices.contains(i))
+        {
+            pickedIndices.insert(i);
+            picked.append(m_list[i]);
+        }
+    }
+    return picked;
+}
+
+int NeighborTable::evictSilent(qint64 heardSince)
+{
+    int evicted = 0;
+    for (int i = m_list.count() - 1; i >= 0; i--)
+    {
+        Monger* neighbor = m_list[i];
+        if (!neighbor->m_isStatic && neighbor->m_lastHeard < heardSince)
+        {
+            qDebug() << "Evicting silent neighbor "
+                << neighbor->m_addrInfo.m_addr.toString() << ":"
+                << neighbor->m_addrInfo.m_port;
+            remove(neighbor);
+            evicted++;
+        }
+    }
+    return evicted;
+}
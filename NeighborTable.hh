@@ -0,0 +1,81 @@
+#ifndef NEIGHBOR_TABLE_HH
+#define NEIGHBOR_TABLE_HH
+
+#include <QHash>
+#include <QVector>
+#include <QList>
+#include <QSet>
+#include <QHostAddress>
+
+#include "addrinfo.hh"
+
+class Monger;
+
+// Hash key for a neighbor's address and port. IPv4 addresses are stored as
+// IPv4-mapped IPv6 addresses so both forms of the same peer compare equal.
+class NeighborKey
+{
+public:
+    NeighborKey(const QHostAddress& addr, quint16 port);
+
+    bool operator==(const NeighborKey& other) const
+    {
+        return m_port == other.m_port
+            && m_words[0] == other.m_words[0] && m_words[1] == other.m_words[1]
+            && m_words[2] == other.m_words[2] && m_words[3] == other.m_words[3];
+    }
+
+    quint32 m_words[4];
+    quint16 m_port;
+};
+
+inline uint qHash(const NeighborKey& key)
+{
+    return (key.m_words[0] * 31u + key.m_words[1]) * 31u
+        + (key.m_words[2] ^ key.m_words[3]) * 65599u + key.m_port;
+}
+
+// Table of neighbors keyed by address and port. Lookups are O(1) and random
+// neighbors can be picked in O(1).
+class NeighborTable
+{
+public:
+    NeighborTable() : m_numAuto(0) { }
+    ~NeighborTable();
+
+    // Returns the neighbor at the given address, or NULL if there is none
+    Monger* find(const AddrInfo& addr) const;
+
+    // Adds a neighbor at the given address if there isn't one already and
+    // returns it. Static neighbors are never evicted for being silent.
+    Monger* add(const AddrInfo& addr, bool isStatic);
+
+    // Removes and deletes the given neighbor
+    void remove(Monger* neighbor);
+
+    int count() const { return m_list.count(); }
+
+    // Number of neighbors that aren't static
+    int autoCount() const { return m_numAuto; }
+    Monger* at(int i) const { return m_list[i]; }
+
+    // Returns a random neighbor, or NULL if there are no neighbors
+    Monger* random() const;
+
+    // Returns up to k distinct random neighbors
+    QList<Monger*> random(int k) const;
+
+    // Removes neighbors that aren't static and haven't been heard from since
+    // the given time, in ms since the epoch. Returns the number removed.
+    int evictSilent(qint64 heardSince);
+
+private:
+    QHash<NeighborKey, Monger*> m_index;
+
+    // All neighbors, in no particular order. Each Monger knows its index.
+    QVector<Monger*> m_list;
+
+    int m_numAuto;
+};
+
+#endif // NEIGHBOR_TABLE_HH
@@ -3,12 +3,20 @@
 #include <QDebug>
 #include <QVariantList>
 #include <QSet>
+#include <QDateTime>
+#include <QtAlgorithms>
+#include <QtEndian>
 
 #include "NetSocket.hh"
 #include "MessageStore.hh"
 #include "RouteTable.hh"
 #include "ChatDialog.hh"
 #include "FileStore.hh"
+#include "Gossip.hh"
+#include "Dht.hh"
+#include "SearchManager.hh"
+#include "FileIndex.hh"
+#include "Rpc.hh"
 #include "finalProject/crypto.hh"
 
 NetSocket* GlobalSocket;
@@ -22,6 +30,13 @@ NetSocket* GlobalSocket;
 #define HOP_LIMIT "HopLimit"
 #define LAST_IP "LastIP"
 #define LAST_PORT "LastPort"
+#define HOPS "Hops"
+#define REQ_ID "ReqId"
+#define PING "Ping"
+#define PONG "Pong"
+#define DIRECT_IP "DirectIP"
+#define DIRECT_PORT "DirectPort"
+#define RELAY "Relay"
 #define BLOCK_REQ "BlockRequest"
 #define BLOCK_REP "BlockReply"
 #define DATA "Data"
@@ -30,6 +45,17 @@ NetSocket* GlobalSocket;
 #define SEARCH_REP "SearchReply"
 #define MATCH_NAMES "MatchNames"
 #define MATCH_IDS "MatchIDs"
+#define NONCE "Nonce"
+#define MATCH_ORIGINS "MatchOrigins"
+#define MORE "More"
+#define SEARCH_MORE "SearchMore"
+#define CANCEL "Cancel"
+#define BLOOM "Bloom"
+#define BLOOM_NEAR "BloomNear"
+#define DHT_STORE "DhtStore"
+#define DHT_FIND "DhtFind"
+#define DHT_FOUND "DhtFound"
+#define DHT_NODES "DhtNodes"
 
 // Crypto-related VariantMap keys
 #define MESSAGE "Message"
@@ -45,7 +71,50 @@ NetSocket* GlobalSocket;
 #define SIGNER "Signer"
 #define SIG_REP "SigResponse"
 
+// Private messages are sent with a fixed header in front of their map:
+// magic (quint32), hop limit (quint8), direct IP (quint32), direct port
+// (quint16), dest (QString). The magic takes the place of the map's entry
+// count, which can never be this large, so the two formats can't be
+// confused. Relays read only the header and patch it in place.
+#define PRIVATE_MAGIC (0xfa570001)
+#define HOP_LIMIT_OFFSET (4)
+#define DIRECT_IP_OFFSET (5)
+#define DIRECT_PORT_OFFSET (9)
+#define PRIVATE_HEADER_BYTES (11)
+
+// Neighbors that were added automatically are evicted after this many ms
+// without sending us anything
+#define NEIGHBOR_TIMEOUT (300000)
+
+// Neighbors we haven't heard from in this many ms are probed every
+// PROBE_INTERVAL ms, and fail after MAX_PROBES go unanswered
+#define PROBE_AFTER (2000)
+#define PROBE_INTERVAL (1000)
+#define MAX_PROBES (3)
+
+// ms between route rumors
+#define ROUTE_INTERVAL (60000)
+
+// ms between file name summaries sent to neighbors
+#define SUMMARY_INTERVAL (30000)
+
+// When some neighbors' summaries match a search, 1/SEARCH_EXPLORE_SHARE of
+// the budget still goes to the neighbors whose summaries don't
+#define SEARCH_EXPLORE_SHARE (4)
+
+// Relayed datagrams larger than this many bytes are sent as bulk traffic
+#define BULK_BYTES (4096)
+
+// ms before a provider's direct address that stopped working is used again
+#define DIRECT_RETRY_AFTER (60000)
+
 NetSocket::NetSocket()
+    : m_sendQueue(this),
+      m_fragmenter(&m_sendQueue),
+      m_statusTimer(this, &NetSocket::sendStatusToRandNeighbor),
+      m_routeTimer(this, &NetSocket::sendRandRouteRumor),
+      m_summaryTimer(this, &NetSocket::sendSummaries),
+      m_livenessTimer(this, &NetSocket::checkNeighbors)
 {
     // Pick a range of four UDP ports to try to allocate by default,
     // computed based on my Unix user ID.
@@ -61,20 +130,23 @@ NetSocket::NetSocket()
 
     m_hostName.setNum(rand());
     m_hostName.prepend(QHostInfo::localHostName());
+    m_hostId = GlobalOrigins->intern(m_hostName);
 
     connect(this, SIGNAL(readyRead()), this, SLOT(gotReadyRead()));
 
-    m_statusTimer = new QTimer(this);
-    connect(m_statusTimer, SIGNAL(timeout()), this, SLOT(sendStatusToRandNeighbor()));
-    m_statusTimer->start(10000);
-
-    m_routeTimer = new QTimer(this);
-    connect(m_routeTimer, SIGNAL(timeout()), this, SLOT(sendRandRouteRumor()));
-    m_routeTimer->start(60000);
+    m_statusTimer.startRepeating(GlobalGossip->statusInterval());
+    m_routeTimer.startRepeating(ROUTE_INTERVAL);
+    m_summaryTimer.startRepeating(SUMMARY_INTERVAL);
+    m_livenessTimer.startRepeating(PROBE_INTERVAL);
 
     m_forward = true;
 }
 
+void NetSocket::applyGossipPolicy()
+{
+    m_statusTimer.startRepeating(GlobalGossip->statusInterval());
+}
+
 void NetSocket::noForward()
 {
     qDebug() << "NO FORWARD";
@@ -112,34 +184,33 @@ bool NetSocket::bind()
     }
 }
 
-Monger* NetSocket::findNeighbor(AddrInfo addrInfo)
-{
-    for (int i = 0; i < m_neighborAddrs.count(); i++)
-    {
-        if (m_neighborAddrs[i] == addrInfo)
-        {
-            return m_neighbors[i];
-        }
-    }
-    return NULL;
-}
-
-void NetSocket::addNeighbor(AddrInfo addrInfo)
+Monger* NetSocket::addNeighbor(AddrInfo addrInfo, bool isStatic)
 {
     if (addrInfo.m_isDns)
     {
         m_pendingAddrs.append(addrInfo);
         QHostInfo::lookupHost(addrInfo.m_dns, this,
                               SLOT(lookedUpDns(QHostInfo)));
-
+        return NULL;
     }
     else
     {
-        m_neighborAddrs.append(addrInfo);
-        m_neighbors.append(new Monger(addrInfo));
+        if (!isStatic
+            && !m_neighbors.find(addrInfo)
+            && !m_admission.allowNewNeighbor(m_neighbors.autoCount()))
+        {
+            return NULL;
+        }
 
-        qDebug() << "Added Neighbor " << addrInfo.m_addr.toString() << ":"
-            << addrInfo.m_port;
+        int oldCount = m_neighbors.count();
+        Monger* neighbor = m_neighbors.add(addrInfo, isStatic);
+
+        if (m_neighbors.count() > oldCount)
+        {
+            qDebug() << "Added Neighbor " << addrInfo.m_addr.toString() << ":"
+                << addrInfo.m_port;
+        }
+        return neighbor;
     }
 }
 
@@ -213,8 +284,85 @@ void NetSocket::gotReadyRead()
 
         AddrInfo addrInfo(address, port);
 
+        // Record the traffic for the neighbor's stats and liveness
+        Monger* neighbor = m_neighbors.find(addrInfo);
+        if (neighbor) neighbor->heard(datagramSize);
+
+        if (Fragmenter::isFragment(datagram))
+        {
+            // Fragments cost little until they add up to a whole datagram,
+            // which is then admitted like any other
+            if (!m_admission.admit(address, port, Admission::Fragment, neighbor != NULL))
+            {
+                return;
+            }
+
+            QByteArray whole;
+            if (!m_fragmenter.receive(datagram, address, port, whole)) return;
+            datagram = whole;
+            datagramSize = whole.size();
+        }
+
+        bool isPrivate = datagramSize >= PRIVATE_HEADER_BYTES
+            && qFromBigEndian<quint32>((const uchar*)datagram.constData()) == PRIVATE_MAGIC;
+        if (!Admission::wellFormed(datagram, isPrivate))
+        {
+            qDebug() << "Received malformed datagram from " << address.toString();
+            return;
+        }
+
         QDataStream dataStream(&datagram, QIODevice::ReadOnly);
-        dataStream >> varMap;
+        if (isPrivate)
+        {
+            // This is a private message. Only read its header unless it's
+            // for us.
+            quint32 magic;
+            quint8 hopLimit;
+            quint32 directIP;
+            quint16 directPort;
+            QString dest;
+            dataStream >> magic >> hopLimit >> directIP >> directPort >> dest;
+            if (dataStream.status() != QDataStream::Ok)
+            {
+                qDebug() << "Received private with a bad header";
+                return;
+            }
+
+            Admission::Kind kind = dest == m_hostName ? Admission::Private : Admission::Relay;
+            if (!m_admission.admit(address, port, kind, neighbor != NULL)) return;
+
+            if (dest != m_hostName)
+            {
+                forwardPrivate(datagram, dest, hopLimit, directIP, address, port);
+                return;
+            }
+
+            dataStream >> varMap;
+            if (dataStream.status() != QDataStream::Ok)
+            {
+                qDebug() << "Received malformed datagram from " << address.toString();
+                return;
+            }
+            varMap.insert(HOP_LIMIT, hopLimit);
+            if (directIP != 0)
+            {
+                varMap.insert(DIRECT_IP, directIP);
+                varMap.insert(DIRECT_PORT, directPort);
+            }
+        }
+        else
+        {
+            dataStream >> varMap;
+            if (dataStream.status() != QDataStream::Ok)
+            {
+                qDebug() << "Received malformed datagram from " << address.toString();
+                return;
+            }
+            if (!m_admission.admit(address, port, admissionKind(varMap), neighbor != NULL))
+            {
+                return;
+            }
+        }
 
         if (varMap.contains(HOP_LIMIT))
         {
@@ -254,7 +402,9 @@ void NetSocket::gotReadyRead()
                 else if (decrypted.contains(BLOCK_REQ))
                 {
                     QByteArray blockReq = decrypted[BLOCK_REQ].toByteArray();
-                    priv = new PrivateBlockReq(dest, hopLimit, blockReq, origin);
+                    PrivateBlockReq* req = new PrivateBlockReq(dest, hopLimit, blockReq, origin);
+                    req->m_relay = decrypted[RELAY].toBool();
+                    priv = req;
                 }
                 else if (decrypted.contains(BLOCK_REP))
                 {
@@ -269,12 +419,21 @@ void NetSocket::gotReadyRead()
                     QString searchTerms = decrypted[SEARCH_REP].toString();
                     QVariantList resultNames = decrypted[MATCH_NAMES].toList();
                     QVariantList resultIds = decrypted[MATCH_IDS].toList();
-                    priv = new PrivateSearchRep(dest,
-                                                hopLimit,
-                                                searchTerms,
-                                                resultNames,
-                                                resultIds,
-                                                origin);
+                    PrivateSearchRep* searchRep = new PrivateSearchRep(dest,
+                                                                       hopLimit,
+                                                                       searchTerms,
+                                                                       resultNames,
+                                                                       resultIds,
+                                                                       origin);
+                    searchRep->m_resultOrigins = decrypted[MATCH_ORIGINS].toList();
+                    searchRep->m_queryId = decrypted[NONCE].toUInt();
+                    searchRep->m_more = decrypted[MORE].toUInt();
+                    priv = searchRep;
+                }
+                else if (decrypted.contains(SEARCH_MORE))
+                {
+                    quint32 token = decrypted[SEARCH_MORE].toUInt();
+                    priv = new PrivateSearchMore(dest, hopLimit, origin, token);
                 }
                 else if (decrypted.contains(CHALLENGE))
                 {
@@ -302,12 +461,59 @@ void NetSocket::gotReadyRead()
                     QByteArray sig = decrypted[SIG_REP].toByteArray();
                     priv = new PrivateSigRep(dest, hopLimit, origin, name, sig);
                 }
+                else if (decrypted.contains(DHT_STORE))
+                {
+                    priv = new PrivateDhtStore(dest,
+                                               hopLimit,
+                                               origin,
+                                               decrypted[DHT_STORE].toByteArray(),
+                                               decrypted[MATCH_NAMES].toList(),
+                                               decrypted[MATCH_IDS].toList());
+                }
+                else if (decrypted.contains(DHT_FIND))
+                {
+                    priv = new PrivateDhtFind(dest,
+                                              hopLimit,
+                                              origin,
+                                              decrypted[DHT_FIND].toByteArray(),
+                                              decrypted[NONCE].toUInt());
+                }
+                else if (decrypted.contains(DHT_FOUND))
+                {
+                    PrivateDhtFound* dhtFound =
+                        new PrivateDhtFound(dest,
+                                            hopLimit,
+                                            origin,
+                                            decrypted[DHT_FOUND].toByteArray(),
+                                            decrypted[NONCE].toUInt());
+                    dhtFound->m_nodes = decrypted[DHT_NODES].toList();
+                    dhtFound->m_fileNames = decrypted[MATCH_NAMES].toList();
+                    dhtFound->m_fileIds = decrypted[MATCH_IDS].toList();
+                    dhtFound->m_providers = decrypted[MATCH_ORIGINS].toList();
+                    priv = dhtFound;
+                }
                 else
                 {
                     qDebug() << "Received private without content";
                     return;
                 }
 
+                priv->m_reqId = decrypted[REQ_ID].toUInt();
+
+                // The first relay records where it heard the message from.
+                // Without one, the message came straight from its origin.
+                if (varMap.contains(DIRECT_IP))
+                {
+                    priv->m_directIP = varMap[DIRECT_IP].toUInt();
+                    priv->m_directPort = varMap[DIRECT_PORT].toUInt();
+                }
+                else
+                {
+                    priv->m_directIP = address.toIPv4Address();
+                    priv->m_directPort = port;
+                    priv->m_directVerified = true;
+                }
+
                 // Verify the signature
                 priv->m_validSig = GlobalCrypto->checkSig(origin, mes, sig);
                 if (priv->m_validSig)
@@ -351,6 +557,18 @@ void NetSocket::gotReadyRead()
                                                          blockReq->m_hash,
                                                          block,
                                                          m_hostName);
+                                blockRep.m_reqId = blockReq->m_reqId;
+
+                                // Bulk data goes straight to the requester
+                                // unless it asked for the route. Only a
+                                // request that came straight from it shows
+                                // where it is; a relay could have recorded
+                                // someone else's address.
+                                if (!blockReq->m_relay && blockReq->m_directVerified)
+                                {
+                                    blockRep.m_directIP = blockReq->m_directIP;
+                                    blockRep.m_directPort = blockReq->m_directPort;
+                                }
                                 sendPrivate(&blockRep);
                             }
                             break;
@@ -358,21 +576,90 @@ void NetSocket::gotReadyRead()
                         case PrivateMessage::BlockRep:
                         {
                             PrivateBlockRep* blockRep = (PrivateBlockRep*)priv;
-                            GlobalFiles->addBlock(blockRep->m_hash, blockRep->m_data);
+                            int providerId = GlobalOrigins->find(blockRep->m_origin);
+                            GlobalRoutes->gotReply(providerId, blockRep->m_hash);
+
+                            // Send later requests straight to the provider, but
+                            // only to an address seen on the packet itself. A
+                            // relay's DirectIP isn't signed, so it could name
+                            // anyone.
+                            if (blockRep->m_directVerified)
+                            {
+                                learnDirect(providerId,
+                                            AddrInfo(QHostAddress(blockRep->m_directIP),
+                                                     blockRep->m_directPort));
+                            }
+
+                            // Replies from older peersters don't echo the
+                            // request ID, so they're matched by hash
+                            if (!GlobalRpc->reply(blockRep))
+                            {
+                                GlobalFiles->addBlock(blockRep->m_hash, blockRep->m_data);
+                            }
                             break;
                         }
                         case PrivateMessage::SearchRep:
                         {
                             PrivateSearchRep* searchRep = (PrivateSearchRep*)priv;
+                            int numResults = qMin(searchRep->m_resultFileNames.count(),
+                                                  searchRep->m_resultHashes.count());
+                            bool hasProviders =
+                                searchRep->m_resultOrigins.count() == numResults;
 
-                            for (int i = 0; i < searchRep->m_resultFileNames.count(); i++)
+                            for (int i = 0; i < numResults; i++)
                             {
                                 QString fileName = searchRep->m_resultFileNames[i].toString();
                                 QByteArray hash = searchRep->m_resultHashes[i].toByteArray();
-                                emit gotSearchResult(searchRep->m_searchTerms,
+
+                                // Results answered from the sender's cache are
+                                // attributed to the node sharing the file
+                                QString provider = hasProviders
+                                    ? searchRep->m_resultOrigins[i].toString()
+                                    : searchRep->m_origin;
+                                if (provider.isEmpty()) provider = searchRep->m_origin;
+
+                                if (provider != m_hostName)
+                                {
+                                    m_searchCache.add(searchRep->m_searchTerms,
+                                                      fileName,
+                                                      hash,
+                                                      provider);
+                                }
+                                emit gotSearchResult(searchRep->m_queryId,
+                                                     searchRep->m_searchTerms,
                                                      fileName,
                                                      hash,
-                                                     searchRep->m_origin);
+                                                     provider);
+                            }
+
+                            // Fetch the next page only if the search still
+                            // wants results
+                            if (searchRep->m_more != 0
+                                && GlobalSearches->wantsMore(searchRep->m_queryId,
+                                                             searchRep->m_searchTerms))
+                            {
+                                PrivateSearchMore more(searchRep->m_origin,
+                                                       10,
+                                                       m_hostName,
+                                                       searchRep->m_more);
+                                sendPrivate(&more);
+                            }
+                            break;
+                        }
+                        case PrivateMessage::SearchMore:
+                        {
+                            PrivateSearchMore* searchMore = (PrivateSearchMore*)priv;
+                            ReplyPages::Reply reply;
+                            if (m_replyPages.take(searchMore->m_token,
+                                                  searchMore->m_origin,
+                                                  reply))
+                            {
+                                sendReplyPage(reply);
+                            }
+                            else
+                            {
+                                qDebug() << "No search reply pages left for token "
+                                    << searchMore->m_token;
                             }
                             break;
                         }
@@ -435,6 +722,7 @@ void NetSocket::gotReadyRead()
                                                      m_hostName,
                                                      sigReq->m_name,
                                                      sig);
+                                sigRep.m_reqId = sigReq->m_reqId;
                                 sendPrivate(&sigRep);
                             }
                             break;
@@ -444,6 +732,7 @@ void NetSocket::gotReadyRead()
                             // Verify the signature. If valid, and we trust the
                             // signer, then trust the sender and sign his key.
                             PrivateSigRep* sigRep = (PrivateSigRep*)priv;
+                            GlobalRpc->reply(sigRep);
                             if (GlobalCrypto->addTrust(sigRep->m_origin,
                                                        sigRep->m_name,
                                                        sigRep->m_sig))
@@ -459,6 +748,51 @@ void NetSocket::gotReadyRead()
                             }
                             break;
                         }
+                        case PrivateMessage::DhtStore:
+                        {
+                            PrivateDhtStore* dhtStore = (PrivateDhtStore*)priv;
+                            GlobalDht->store(dhtStore->m_origin,
+                                             dhtStore->m_key,
+                                             dhtStore->m_fileNames,
+                                             dhtStore->m_fileIds);
+                            break;
+                        }
+                        case PrivateMessage::DhtFind:
+                        {
+                            PrivateDhtFind* dhtFind = (PrivateDhtFind*)priv;
+                            PrivateDhtFound dhtFound(dhtFind->m_origin,
+                                                     10,
+                                                     m_hostName,
+                                                     dhtFind->m_key,
+                                                     dhtFind->m_lookupId);
+
+                            QList<Dht::Record> records;
+                            GlobalDht->find(dhtFind->m_origin,
+                                            dhtFind->m_key,
+                                            dhtFound.m_nodes,
+                                            records);
+                            for (int i = 0; i < records.count(); i++)
+                            {
+                                dhtFound.m_fileNames.append(records[i].m_fileName);
+                                dhtFound.m_fileIds.append(records[i].m_fileId);
+                                dhtFound.m_providers.append(records[i].m_provider);
+                            }
+                            sendPrivate(&dhtFound);
+                            break;
+                        }
+                        case PrivateMessage::DhtFound:
+                        {
+                            PrivateDhtFound* dhtFound = (PrivateDhtFound*)priv;
+                            GlobalRoutes->gotReply(GlobalOrigins->find(dhtFound->m_origin),
+                                                   QByteArray::number(dhtFound->m_lookupId));
+                            GlobalDht->found(dhtFound->m_origin,
+                                             dhtFound->m_lookupId,
+                                             dhtFound->m_nodes,
+                                             dhtFound->m_fileNames,
+                                             dhtFound->m_fileIds,
+                                             dhtFound->m_providers);
+                            break;
+                        }
                         default:
                         {
                             qDebug() << "Trying to process undef PrivateMessage";
@@ -473,19 +807,38 @@ void NetSocket::gotReadyRead()
                 // Forward this private message
                 qDebug() << "Routing private w/DEST = " << dest << ", HOP_LIMIT = " << hopLimit-1;
                 varMap[HOP_LIMIT] = hopLimit - 1;
+
+                // As the first relay, record where the origin can be reached
+                // so that the destination can reply directly
+                if (!varMap.contains(DIRECT_IP) && address.toIPv4Address() != 0)
+                {
+                    varMap.insert(DIRECT_IP, address.toIPv4Address());
+                    varMap.insert(DIRECT_PORT, port);
+                }
                 sendPrivate(varMap);
             }
         }
+        else if (varMap.contains(PING))
+        {
+            // This is a liveness probe; the reply is all that matters
+            QVariantMap pong;
+            pong.insert(PONG, true);
+            sendMap(pong, address, port, SendQueue::Control);
+        }
+        else if (varMap.contains(PONG))
+        {
+            // Any datagram proves the neighbor is alive, but a pong also
+            // shows that it's worth probing
+            if (neighbor) neighbor->m_answersProbes = true;
+        }
         else if (varMap.contains(WANT))
         {
             // This is a status message
             QVariantMap remoteStatus(varMap[WANT].toMap());
 
-            if (!findNeighbor(addrInfo))
-            {
-                addNeighbor(addrInfo);
-            }
-            findNeighbor(addrInfo)->receiveStatus(remoteStatus);
+            if (!neighbor) neighbor = addNeighbor(addrInfo, false);
+            if (!neighbor) return;
+            neighbor->receiveStatus(remoteStatus);
         }
         else if (varMap.contains(MESSAGE)
                  || varMap.contains(BUDGET))
@@ -493,10 +846,8 @@ void NetSocket::gotReadyRead()
             // This is a rumor message or a search request
 
             // Add sender to neighbors
-            if (!findNeighbor(addrInfo))
-            {
-                addNeighbor(addrInfo);
-            }
+            if (!neighbor) neighbor = addNeighbor(addrInfo, false);
+            if (!neighbor) return;
 
             // Extract top-level entries in map
             QVariantMap mesMap = varMap[MESSAGE].toMap();
@@ -505,44 +856,143 @@ void NetSocket::gotReadyRead()
             QList<QVariant> signers = varMap[PUBKEY_SIGNERS].toList();
 
             QString origin = mesMap[ORIGIN].toString();
+            int originId = GlobalOrigins->find(origin);
 
-            // Before checking signature, add the public key to our store of
-            // public keys
-            GlobalCrypto->addPubKey(origin, pubKey);
-
-            bool validSig = GlobalCrypto->checkSig(origin, mesMap, sig);
+            bool validSig;
+            if (originId >= 0)
+            {
+                // Before checking signature, add the public key to our store
+                // of public keys
+                GlobalCrypto->addPubKey(originId, pubKey);
+                validSig = GlobalCrypto->checkSig(originId, mesMap, sig);
+            }
+            else
+            {
+                // Only register a new origin once it has signed the message,
+                // so that made-up names can't grow the tables keyed by origin
+                if (!GlobalCrypto->checkSigWithKey(pubKey, mesMap, sig))
+                {
+                    qDebug() << "Dropping unsigned message from new origin " << origin;
+                    return;
+                }
+                originId = GlobalOrigins->intern(origin);
+                GlobalCrypto->addPubKey(originId, pubKey);
+                validSig = true;
+            }
             if (validSig) qDebug() << "VALID SIGNATURE FROM " << origin;
 
             // Update our key sig list for the origin of this message
-            if (validSig) GlobalCrypto->updateKeySigList(origin, signers);
+            if (validSig) GlobalCrypto->updateKeySigList(originId, signers);
 
             if (varMap.contains(BUDGET))
             {
                 // This is a search request
                 QString searchTerms = mesMap[SEARCH].toString();
                 int budget = varMap[BUDGET].toInt();
+                quint32 nonce = mesMap[NONCE].toUInt();
+                bool cancel = mesMap[CANCEL].toBool();
 
                 // Drop search requests that I sent
-                if (origin == m_hostName)
+                if (originId == m_hostId)
                 {
                     return;
                 }
 
+                if (cancel)
+                {
+                    // Only the origin can cancel its search, and each cancel
+                    // is forwarded once
+                    if (nonce == 0 || !validSig) return;
+
+                    bool isNew;
+                    QueryCache::Entry& query = m_seenQueries.lookup(originId, nonce, &isNew);
+                    if (query.m_cancelled) return;
+
+                    qDebug() << "Received search cancel: " << searchTerms;
+                    query.m_cancelled = true;
+                    query.m_handled = true;
+                    if (budget - 1 > 0)
+                    {
+                        sendSearchRequest(searchTerms,
+                                          budget - 1,
+                                          nonce,
+                                          origin,
+                                          sig,
+                                          true);
+                    }
+                    return;
+                }
+
+                // A repeat of a query we've already answered only has its
+                // budget forwarded. Requests without a nonce can't be told
+                // apart, so they're always handled.
+                QueryCache::Entry* query = NULL;
+                if (nonce != 0)
+                {
+                    bool isNew;
+                    query = &m_seenQueries.lookup(originId, nonce, &isNew);
+                    if (query->m_cancelled)
+                    {
+                        qDebug() << "Dropping request of canceled search: " << searchTerms;
+                        return;
+                    }
+                }
+
                 if (budget > 0)
                 {
-                    qDebug() << "Received good search request: " << searchTerms;
-                    QList<QString> fileNames;
-                    QList<QByteArray> hashes;
-                    if (GlobalFiles->findFile(searchTerms, fileNames, hashes))
+                    if (!query || !query->m_handled)
+                    {
+                        qDebug() << "Received good search request: " << searchTerms;
+                        QList<QString> fileNames;
+                        QList<QByteArray> hashes;
+                        QList<QString> providers;
+                        GlobalFiles->findFile(searchTerms, fileNames, hashes);
+                        for (int i = 0; i < fileNames.count(); i++)
+                        {
+                            providers.append(m_hostName);
+                        }
+
+                        // Add results cached from other nodes' replies,
+                        // except the requester's own files
+                        QList<SearchCache::Result> cached = m_searchCache.find(searchTerms);
+                        for (int i = 0; i < cached.count(); i++)
+                        {
+                            if (cached[i].m_provider != origin
+                                && !hashes.contains(cached[i].m_fileId))
+                            {
+                                fileNames.append(cached[i].m_fileName);
+                                hashes.append(cached[i].m_fileId);
+                                providers.append(cached[i].m_provider);
+                            }
+                        }
+
+                        if (!fileNames.isEmpty())
+                        {
+                            qDebug() << "Found matches for search request; sending reply";
+                            if (cached.isEmpty()) providers.clear();
+                            sendSearchReply(searchTerms,
+                                            fileNames,
+                                            hashes,
+                                            providers,
+                                            origin,
+                                            nonce);
+                        }
+                        if (query) query->m_handled = true;
+                    }
+                    else
                     {
-                        qDebug() << "Found matches for search request; sending reply";
-                        sendSearchReply(searchTerms, fileNames, hashes, origin);
+                        qDebug() << "Received repeat search request: " << searchTerms;
                     }
 
                     budget--;
                     if (budget > 0)
                     {
-                        sendSearchRequest(searchTerms, budget, origin);
+                        sendSearchRequest(searchTerms,
+                                          budget,
+                                          nonce,
+                                          origin,
+                                          sig,
+                                          false);
                     }
                 }
                 else
@@ -556,7 +1006,7 @@ void NetSocket::gotReadyRead()
 
                 // Create and populate MessageInfo with chat text, signature,
                 // lastRoute
-                MessageInfo mesInf(origin, mesMap[SEQ_NO].toInt());
+                MessageInfo mesInf(originId, mesMap[SEQ_NO].toInt());
 
                 mesInf.addSig(sig, validSig);
 
@@ -575,37 +1025,52 @@ void NetSocket::gotReadyRead()
                     int lastPort = varMap[LAST_PORT].toInt();
                     AddrInfo lastAddrInfo(lastAddress, lastPort);
 
-                    if (!findNeighbor(lastAddrInfo))
-                    {
-                        addNeighbor(lastAddrInfo);
-                    }
+                    addNeighbor(lastAddrInfo, false);
                 }
                 mesInf.addLastRoute(address.toIPv4Address(), (quint16)port);
 
+                // Rumors count the hops they've taken from their origin.
+                // Older peersters don't; 0 leaves the guess to GlobalRoutes.
+                mesInf.m_hops = varMap.contains(HOPS) ? varMap[HOPS].toInt() + 1 : 0;
+
                 // Register this message
-                findNeighbor(addrInfo)->receiveMessage(mesInf, addrInfo, isDirect);
+                neighbor->receiveMessage(mesInf, addrInfo, isDirect);
             }
 
             // If we don't already trust this individual, check their key
             // signers to see if we trust any of them. If so, request the sig
-            if (validSig && !GlobalCrypto->isTrusted(origin))
+            if (validSig && !GlobalCrypto->isTrusted(originId))
             {
                 // check signers one by one to see if we trust any
                 for (int i = 0; i < signers.count(); i++)
                 {
                     if (GlobalCrypto->isTrusted(signers[i].toString()))
                     {
-                        // Request the signature of this individual we trust
-                        PrivateSigReq sigReq(origin,
-                                             10,
-                                             m_hostName,
-                                             signers[i].toString());
-                        sendPrivate(&sigReq);
+                        // Request the signature of this individual we
+                        // trust. Every rumor from origin would ask again, so
+                        // requests in flight are shared.
+                        PrivateSigReq* sigReq = new PrivateSigReq(origin,
+                                                                  10,
+                                                                  m_hostName,
+                                                                  signers[i].toString());
+                        GlobalRpc->call(sigReq,
+                                        "SigRequest:" + signers[i].toString().toUtf8(),
+                                        NULL,
+                                        2);
                         break;
                     }
                 }
             }
         }
+        else if (varMap.contains(BLOOM))
+        {
+            // This is a file name summary from a neighbor
+            if (neighbor)
+            {
+                neighbor->m_bloom.fromByteArray(varMap[BLOOM].toByteArray());
+                neighbor->m_bloomNear.fromByteArray(varMap[BLOOM_NEAR].toByteArray());
+            }
+        }
         else
         {
             // Not a point-to-point, search request, status, or rumor message.
@@ -624,18 +1089,21 @@ void NetSocket::inputMessage(QString& message)
     AddrInfo addr(QHostAddress(QHostAddress::LocalHost), m_myPort);
 
     GlobalMessages->recordMessage(mesInf, addr, true/*isDirect*/);
-    sendToRandNeighbor(mesInf);
+    if (GlobalGossip->pushes())
+    {
+        sendToRandNeighbor(mesInf, GlobalGossip->fanout());
+    }
 }
 
-void NetSocket::sendToRandNeighbor(MessageInfo& mesInf)
+void NetSocket::sendToRandNeighbor(MessageInfo& mesInf, int fanout)
 {
     // If this is a route rumor message, we're actually going to send it to
     // all our neighbors.
     if (mesInf.m_isRoute)
     {
-        for (int i = 0; i < m_neighborAddrs.count(); i++)
+        for (int i = 0; i < m_neighbors.count(); i++)
         {
-            AddrInfo addrInfo = m_neighborAddrs[i];
+            AddrInfo addrInfo = m_neighbors.at(i)->m_addrInfo;
 
             // do not timeout on sending messages here, since we're sending
             // the route rumor to everyone anyway
@@ -644,19 +1112,29 @@ void NetSocket::sendToRandNeighbor(MessageInfo& mesInf)
     }
     else
     {
-        int i = rand() % m_neighborAddrs.count();
-        AddrInfo addrInfo = m_neighborAddrs[i];
-
-        sendMessage(mesInf, addrInfo.m_addr, addrInfo.m_port);
+        QList<Monger*> neighbors = m_neighbors.random(fanout);
+        for (int i = 0; i < neighbors.count(); i++)
+        {
+            AddrInfo addrInfo = neighbors[i]->m_addrInfo;
+            sendMessage(mesInf, addrInfo.m_addr, addrInfo.m_port);
+        }
     }
 }
 
 void NetSocket::sendStatusToRandNeighbor()
 {
-    int i = rand() % m_neighborAddrs.count();
-    AddrInfo addrInfo = m_neighborAddrs[i];
-
-    sendStatus(addrInfo.m_addr, addrInfo.m_port);
+    // Drop neighbors we haven't heard from in a while before picking one
+    m_neighbors.evictSilent(QDateTime::currentMSecsSinceEpoch() - NEIGHBOR_TIMEOUT);
+
+    // When pulling, our status goes to fanout neighbors so that they send us
+    // the rumors we're missing
+    int fanout = GlobalGossip->pulls() ? GlobalGossip->fanout() : 1;
+    QList<Monger*> neighbors = m_neighbors.random(fanout);
+    for (int i = 0; i < neighbors.count(); i++)
+    {
+        AddrInfo addrInfo = neighbors[i]->m_addrInfo;
+        sendStatus(addrInfo.m_addr, addrInfo.m_port);
+    }
 }
 
 void NetSocket::sendMessage(MessageInfo& mesInf,
@@ -666,7 +1144,7 @@ void NetSocket::sendMessage(MessageInfo& mesInf,
 {
     QVariantMap mes;
     if (!mesInf.m_isRoute) mes.insert(CHAT_TEXT, mesInf.m_body);
-    mes.insert(ORIGIN, mesInf.m_host);
+    mes.insert(ORIGIN, mesInf.host());
     mes.insert(SEQ_NO, mesInf.m_seqNo);
     if (mesInf.m_hasLastRoute)
     {
@@ -676,7 +1154,14 @@ void NetSocket::sendMessage(MessageInfo& mesInf,
 
     QVariantMap varMap;
     varMap.insert(MESSAGE, mes);
-    if (mesInf.m_host == m_hostName)
+
+    // Outside the signature, since every hop increments it. A rumor that
+    // came through an older peerster has no count to pass on.
+    if (mesInf.m_hops > 0 || mesInf.m_originId == m_hostId)
+    {
+        varMap.insert(HOPS, mesInf.m_hops);
+    }
+    if (mesInf.m_originId == m_hostId)
     {
         varMap.insert(SIG, GlobalCrypto->sign(mes));
         varMap.insert(PUBKEY, GlobalCrypto->pubKeyVal());
@@ -685,22 +1170,23 @@ void NetSocket::sendMessage(MessageInfo& mesInf,
     else
     {
         varMap.insert(SIG, mesInf.m_sig);
-        varMap.insert(PUBKEY, GlobalCrypto->pubKeyVal(mesInf.m_host));
-        varMap.insert(PUBKEY_SIGNERS, GlobalCrypto->keySigList(mesInf.m_sig));
+        varMap.insert(PUBKEY, GlobalCrypto->pubKeyVal(mesInf.m_originId));
+        varMap.insert(PUBKEY_SIGNERS, GlobalCrypto->keySigList(mesInf.m_originId));
     }
 
-    sendMap(varMap, address, port);
-
-    AddrInfo addrInfo(address, port);
-    if (!findNeighbor(addrInfo))
-    {
-        addNeighbor(addrInfo);
-    }
+    // Route rumors keep the routing table fresh, so they can't wait
+    sendMap(varMap,
+            address,
+            port,
+            mesInf.m_isRoute ? SendQueue::Control : SendQueue::Interactive);
 
     if (startTimer)
     {
-        findNeighbor(addrInfo)->m_lastSent = mesInf;
-        findNeighbor(addrInfo)->startTimer();
+        Monger* neighbor = addNeighbor(AddrInfo(address, port), false);
+        if (!neighbor) return;
+        neighbor->m_lastSent = mesInf;
+        neighbor->startTimer();
+        GlobalGossip->recordPush(mesInf);
     }
 }
 
@@ -712,24 +1198,108 @@ void NetSocket::sendStatus(QHostAddress address, int port)
     statusMessage.insert(ORIGIN, m_hostName);
     delete status;
 
-    sendMap(statusMessage, address, port);
+    sendMap(statusMessage, address, port, SendQueue::Control);
+}
+
+void NetSocket::forwardPrivate(QByteArray& datagram,
+                               const QString& dest,
+                               int hopLimit,
+                               quint32 directIP,
+                               QHostAddress from,
+                               int fromPort)
+{
+    if (hopLimit - 1 <= 0 || !m_forward) return;
+
+    AddrInfo addr;
+    if (!GlobalRoutes->getNextHop(dest, addr))
+    {
+        qDebug() << "Cannot route private message to " << dest;
+        return;
+    }
+
+    uchar* header = (uchar*)datagram.data();
+    header[HOP_LIMIT_OFFSET] = hopLimit - 1;
+
+    // As the first relay, record where the origin can be reached so that
+    // the destination can reply directly
+    if (directIP == 0 && from.toIPv4Address() != 0)
+    {
+        qToBigEndian<quint32>(from.toIPv4Address(), header + DIRECT_IP_OFFSET);
+        qToBigEndian<quint16>(fromPort, header + DIRECT_PORT_OFFSET);
+    }
+
+    sendDatagram(datagram, addr.m_addr, addr.m_port, relayClass(datagram.size()));
+}
+
+Admission::Kind NetSocket::admissionKind(const QVariantMap& varMap)
+{
+    if (varMap.contains(HOP_LIMIT))
+    {
+        // A private in the old format, without a header
+        QString dest = varMap[MESSAGE].toMap()[DEST].toString();
+        return dest == m_hostName ? Admission::Private : Admission::Relay;
+    }
+    else if (varMap.contains(BUDGET))
+    {
+        return Admission::Search;
+    }
+    else if (varMap.contains(MESSAGE))
+    {
+        return Admission::Rumor;
+    }
+    else if (varMap.contains(BLOOM))
+    {
+        return Admission::Summary;
+    }
+    else
+    {
+        return Admission::Control;
+    }
+}
+
+SendQueue::Class NetSocket::relayClass(int size)
+{
+    return size > BULK_BYTES ? SendQueue::Bulk : SendQueue::Interactive;
 }
 
-void NetSocket::sendMap(const QVariantMap& varMap, QHostAddress address, int port)
+void NetSocket::sendMap(const QVariantMap& varMap,
+                        QHostAddress address,
+                        int port,
+                        SendQueue::Class cls)
 {
     QByteArray datagram;
     datagram.resize(sizeof(varMap));
     QDataStream dataStream(&datagram, QIODevice::WriteOnly);
     dataStream << varMap;
 
-    writeDatagram(datagram, address, port);
+    sendDatagram(datagram, address, port, cls);
+}
+
+void NetSocket::sendDatagram(const QByteArray& datagram,
+                             QHostAddress address,
+                             int port,
+                             SendQueue::Class cls)
+{
+    if (Fragmenter::needsFragments(datagram.size()))
+    {
+        m_fragmenter.send(datagram, address, port, cls);
+    }
+    else
+    {
+        m_sendQueue.send(datagram, address, port, cls);
+    }
+
+    Monger* neighbor = m_neighbors.find(AddrInfo(address, port));
+    if (neighbor) neighbor->sent(datagram.size());
 }
 
-void NetSocket::sendMap(const QVariantMap& varMap, const AddrInfo& addr)
+void NetSocket::sendMap(const QVariantMap& varMap,
+                        const AddrInfo& addr,
+                        SendQueue::Class cls)
 {
     if (!addr.m_isDns)
     {
-        sendMap(varMap, addr.m_addr, addr.m_port);
+        sendMap(varMap, addr.m_addr, addr.m_port, cls);
     }
     else
     {
@@ -741,11 +1311,51 @@ void NetSocket::sendPrivate(PrivateMessage* priv)
 {
     AddrInfo addr;
 
-    if (GlobalRoutes->getNextHop(priv->m_dest, addr))
+    // Messages with a direct address for dest skip the relays
+    bool direct = priv->hasDirect();
+    if (direct)
+    {
+        addr = AddrInfo(QHostAddress(priv->m_directIP), priv->m_directPort);
+    }
+    else if (priv->type() == PrivateMessage::BlockReq)
+    {
+        // So do block requests to a provider whose replies showed where it
+        // is. A retry may mean that address doesn't work, so it follows the
+        // route and the address is set aside for a while.
+        int destId = GlobalOrigins->find(priv->m_dest);
+        if (((PrivateBlockReq*)priv)->m_relay)
+        {
+            if (m_directAddrs.remove(destId) > 0)
+            {
+                m_directFailed.insert(destId, QDateTime::currentMSecsSinceEpoch());
+            }
+        }
+        else if (m_directAddrs.contains(destId))
+        {
+            addr = m_directAddrs[destId];
+            direct = true;
+        }
+    }
+
+    bool haveAddr = direct;
+    if (!direct)
+    {
+        if (priv->type() == PrivateMessage::BlockReq
+            || priv->type() == PrivateMessage::BlockRep)
+        {
+            // Transfers spread their blocks over every good path
+            haveAddr = GlobalRoutes->getBulkHop(priv->m_dest, addr);
+        }
+        else
+        {
+            haveAddr = GlobalRoutes->getNextHop(priv->m_dest, addr);
+        }
+    }
+
+    if (haveAddr)
     {
         // Make top-level map, out
         QVariantMap out;
-        out.insert(HOP_LIMIT, priv->m_hopLimit);
 
         // Make MESSAGE map, contained in the top-level map
         QVariantMap mes;
@@ -766,6 +1376,7 @@ void NetSocket::sendPrivate(PrivateMessage* priv)
             {
                 PrivateBlockReq* blockReq = (PrivateBlockReq*)priv;
                 crypt.insert(BLOCK_REQ, blockReq->m_hash);
+                if (blockReq->m_relay) crypt.insert(RELAY, true);
                 break;
             }
             case PrivateMessage::BlockRep:
@@ -781,6 +1392,24 @@ void NetSocket::sendPrivate(PrivateMessage* priv)
                 crypt.insert(SEARCH_REP, searchRep->m_searchTerms);
                 crypt.insert(MATCH_NAMES, searchRep->m_resultFileNames);
                 crypt.insert(MATCH_IDS, searchRep->m_resultHashes);
+                if (!searchRep->m_resultOrigins.isEmpty())
+                {
+                    crypt.insert(MATCH_ORIGINS, searchRep->m_resultOrigins);
+                }
+                if (searchRep->m_queryId != 0)
+                {
+                    crypt.insert(NONCE, searchRep->m_queryId);
+                }
+                if (searchRep->m_more != 0)
+                {
+                    crypt.insert(MORE, searchRep->m_more);
+                }
+                break;
+            }
+            case PrivateMessage::SearchMore:
+            {
+                PrivateSearchMore* searchMore = (PrivateSearchMore*)priv;
+                crypt.insert(SEARCH_MORE, searchMore->m_token);
                 break;
             }
             case PrivateMessage::Challenge:
@@ -814,12 +1443,56 @@ void NetSocket::sendPrivate(PrivateMessage* priv)
                 crypt.insert(SIG_REP, sigRep->m_sig);
                 break;
             }
+            case PrivateMessage::DhtStore:
+            {
+                PrivateDhtStore* dhtStore = (PrivateDhtStore*)priv;
+                crypt.insert(DHT_STORE, dhtStore->m_key);
+                crypt.insert(MATCH_NAMES, dhtStore->m_fileNames);
+                crypt.insert(MATCH_IDS, dhtStore->m_fileIds);
+                break;
+            }
+            case PrivateMessage::DhtFind:
+            {
+                PrivateDhtFind* dhtFind = (PrivateDhtFind*)priv;
+                crypt.insert(DHT_FIND, dhtFind->m_key);
+                crypt.insert(NONCE, dhtFind->m_lookupId);
+                break;
+            }
+            case PrivateMessage::DhtFound:
+            {
+                PrivateDhtFound* dhtFound = (PrivateDhtFound*)priv;
+                crypt.insert(DHT_FOUND, dhtFound->m_key);
+                crypt.insert(NONCE, dhtFound->m_lookupId);
+                crypt.insert(DHT_NODES, dhtFound->m_nodes);
+                crypt.insert(MATCH_NAMES, dhtFound->m_fileNames);
+                crypt.insert(MATCH_IDS, dhtFound->m_fileIds);
+                crypt.insert(MATCH_ORIGINS, dhtFound->m_providers);
+                break;
+            }
             default:
             {
                 qDebug() << "Trying to send undef PrivateMessage";
                 return;
             }
         }
+        if (priv->m_reqId != 0) crypt.insert(REQ_ID, priv->m_reqId);
+
+        // Requests sent along the route time the path for GlobalRoutes
+        if (!direct)
+        {
+            if (priv->type() == PrivateMessage::BlockReq)
+            {
+                GlobalRoutes->sentRequest(GlobalOrigins->find(priv->m_dest),
+                                          ((PrivateBlockReq*)priv)->m_hash,
+                                          addr);
+            }
+            else if (priv->type() == PrivateMessage::DhtFind)
+            {
+                GlobalRoutes->sentRequest(GlobalOrigins->find(priv->m_dest),
+                                          QByteArray::number(((PrivateDhtFind*)priv)->m_lookupId),
+                                          addr);
+            }
+        }
 
         QByteArray cryptKey;
         QByteArray cryptArray = GlobalCrypto->encrypt(priv->m_dest,
@@ -834,7 +1507,21 @@ void NetSocket::sendPrivate(PrivateMessage* priv)
         QByteArray sig = GlobalCrypto->sign(mes);
         out.insert(SIG, sig);
 
-        sendMap(out, addr);
+        // Put the header that relays read in front of the map
+        QByteArray datagram;
+        QDataStream dataStream(&datagram, QIODevice::WriteOnly);
+        dataStream << (quint32)PRIVATE_MAGIC
+                   << (quint8)priv->m_hopLimit
+                   << (quint32)0
+                   << (quint16)0
+                   << priv->m_dest
+                   << out;
+
+        sendDatagram(datagram,
+                     addr.m_addr,
+                     addr.m_port,
+                     priv->type() == PrivateMessage::BlockRep
+                         ? SendQueue::Bulk : SendQueue::Interactive);
     }
     else
     {
@@ -850,7 +1537,10 @@ void NetSocket::sendPrivate(const QVariantMap& priv)
 
     if (GlobalRoutes->getNextHop(dest, addr))
     {
-        sendMap(priv, addr);
+        QByteArray datagram;
+        QDataStream dataStream(&datagram, QIODevice::WriteOnly);
+        dataStream << priv;
+        sendDatagram(datagram, addr.m_addr, addr.m_port, relayClass(datagram.size()));
     }
     else
     {
@@ -869,7 +1559,7 @@ void NetSocket::sendPrivate(QString& dest, QString& chatText)
 
 void NetSocket::sendRandRouteRumor()
 {
-    MessageInfo mesInf(m_hostName, m_seqNo);
+    MessageInfo mesInf(m_hostId, m_seqNo);
 
     m_seqNo++;
 
@@ -879,27 +1569,20 @@ void NetSocket::sendRandRouteRumor()
     sendToRandNeighbor(mesInf);
 }
 
-void NetSocket::requestBlock(QByteArray& hash, QString& host)
-{
-    PrivateBlockReq priv(host, 10, hash, m_hostName);
-    sendPrivate(&priv);
-}
-
-void NetSocket::sendSearchRequest(QString &searchTerms,
-                                  int budget,
-                                  QString origin,
-                                  QByteArray sig)
+void NetSocket::splitBudget(int budget,
+                            QList<Monger*> neighbors,
+                            QList<QPair<Monger*, int> >& allocOut)
 {
-    if (origin.isEmpty()) origin = m_hostName;
+    if (neighbors.isEmpty() || budget <= 0) return;
 
-    int baseBudget = budget / m_neighborAddrs.count();
-    int extraBudget = budget % m_neighborAddrs.count();
+    int baseBudget = budget / neighbors.count();
+    int extraBudget = budget % neighbors.count();
 
     QList<int> budgetAlloc;
     if (baseBudget > 0)
     {
         // We have enough budget for everyone to get baseBudget
-        for (int i = 0; i < m_neighborAddrs.count(); i++) budgetAlloc.append(baseBudget);
+        for (int i = 0; i < neighbors.count(); i++) budgetAlloc.append(baseBudget);
 
         // Now spread extraBudget among as many peers as we can
         for (int i = 0; i < extraBudget; i++) budgetAlloc[i]++;
@@ -911,59 +1594,193 @@ void NetSocket::sendSearchRequest(QString &searchTerms,
         for (int i = 0; i < extraBudget; i++) budgetAlloc.append(1);
     }
 
-    // Now send the messages with the calculated budgets
-    QList<AddrInfo> neighbors = m_neighborAddrs;
-    if (budgetAlloc.count() > neighbors.count())
-    {
-        qDebug() << "BUG!!! budgetAlloc.count() > neighbors.count() !!!!!!";
-        return;
-    }
+    // Hand the budgets out to random neighbors
     for (int i = 0; i < budgetAlloc.count(); i++)
     {
-        QVariantMap message;
-        QVariantMap varMap;
-        message.insert(ORIGIN, origin);
-        message.insert(SEARCH, searchTerms);
-
-        varMap.insert(MESSAGE, message);
-        varMap.insert(BUDGET, budgetAlloc[i]);
+        int j = rand() % neighbors.count();
+        allocOut.append(qMakePair(neighbors[j], budgetAlloc[i]));
+        neighbors.removeAt(j);
+    }
+}
 
-        if (origin == m_hostName)
+void NetSocket::sendSearchRequest(QString &searchTerms,
+                                  int budget,
+                                  quint32 nonce,
+                                  QString origin,
+                                  QByteArray sig,
+                                  bool cancel)
+{
+    if (origin.isEmpty()) origin = m_hostName;
+    if (m_neighbors.count() == 0) return;
+
+    // Sort neighbors by whether their summaries say they, or their own
+    // neighbors, might share a matching file
+    QList<Monger*> sharing;
+    QList<Monger*> near;
+    QList<Monger*> others;
+    for (int i = 0; i < m_neighbors.count(); i++)
+    {
+        Monger* neighbor = m_neighbors.at(i);
+        if (neighbor->m_bloom.mightMatchAny(searchTerms))
+        {
+            sharing.append(neighbor);
+        }
+        else if (neighbor->m_bloomNear.mightMatchAny(searchTerms))
         {
-            varMap.insert(SIG, GlobalCrypto->sign(message));
-            varMap.insert(PUBKEY, GlobalCrypto->pubKeyVal());
-            varMap.insert(PUBKEY_SIGNERS, GlobalCrypto->keySigList());
+            near.append(neighbor);
         }
         else
         {
-            varMap.insert(SIG, sig);
-            varMap.insert(PUBKEY, GlobalCrypto->pubKeyVal(origin));
-            varMap.insert(PUBKEY_SIGNERS, GlobalCrypto->keySigList(origin));
+            others.append(neighbor);
         }
+    }
 
-        int j = rand() % neighbors.count();
-        AddrInfo addrInfo = neighbors[j];
-        sendMap(varMap, addrInfo);
-        neighbors.removeAt(j);
+    // Route the budget toward promising neighbors, keeping a share for the
+    // rest in case summaries are stale or missing. Without any promising
+    // neighbors this is the plain random split.
+    QList<QPair<Monger*, int> > alloc;
+    if (sharing.isEmpty() && near.isEmpty())
+    {
+        splitBudget(budget, others, alloc);
+    }
+    else
+    {
+        int exploreBudget = others.isEmpty() ? 0 : budget / SEARCH_EXPLORE_SHARE;
+        int guidedBudget = budget - exploreBudget;
+        int nearBudget = near.isEmpty() ? 0
+            : (sharing.isEmpty() ? guidedBudget : guidedBudget / 3);
+
+        splitBudget(guidedBudget - nearBudget, sharing, alloc);
+        splitBudget(nearBudget, near, alloc);
+        splitBudget(exploreBudget, others, alloc);
+    }
+
+    QVariantMap message;
+    message.insert(ORIGIN, origin);
+    message.insert(SEARCH, searchTerms);
+    if (nonce != 0) message.insert(NONCE, nonce);
+    if (cancel) message.insert(CANCEL, true);
+
+    QVariantMap varMap;
+    varMap.insert(MESSAGE, message);
+
+    if (origin == m_hostName)
+    {
+        varMap.insert(SIG, GlobalCrypto->sign(message));
+        varMap.insert(PUBKEY, GlobalCrypto->pubKeyVal());
+        varMap.insert(PUBKEY_SIGNERS, GlobalCrypto->keySigList());
+    }
+    else
+    {
+        varMap.insert(SIG, sig);
+        varMap.insert(PUBKEY, GlobalCrypto->pubKeyVal(origin));
+        varMap.insert(PUBKEY_SIGNERS, GlobalCrypto->keySigList(origin));
+    }
+
+    // Now send the messages with the calculated budgets
+    for (int i = 0; i < alloc.count(); i++)
+    {
+        varMap.insert(BUDGET, alloc[i].second);
+        sendMap(varMap, alloc[i].first->m_addrInfo);
+    }
+}
+
+void NetSocket::sendSummaries()
+{
+    // Our near summary covers what our neighbors share themselves
+    BloomFilter near;
+    for (int i = 0; i < m_neighbors.count(); i++)
+    {
+        near.unite(m_neighbors.at(i)->m_bloom);
+    }
+
+    QVariantMap varMap;
+    varMap.insert(BLOOM, GlobalFiles->summary().toByteArray());
+    varMap.insert(BLOOM_NEAR, near.toByteArray());
+
+    for (int i = 0; i < m_neighbors.count(); i++)
+    {
+        sendMap(varMap, m_neighbors.at(i)->m_addrInfo, SendQueue::Bulk);
     }
 }
 
 void NetSocket::sendSearchReply(QString &searchTerms,
                                 QList<QString> &fileNames,
                                 QList<QByteArray> &hashes,
-                                QString &dest)
+                                QList<QString> &providers,
+                                QString &dest,
+                                quint32 queryId)
+{
+    // Rank the results so the best matches go out in the first page
+    QList<QPair<int, int> > ranked;
+    for (int i = 0; i < fileNames.count(); i++)
+    {
+        ranked.append(qMakePair(-FileIndex::score(fileNames[i], searchTerms), i));
+    }
+    qStableSort(ranked);
+
+    ReplyPages::Reply reply;
+    reply.m_terms = searchTerms;
+    reply.m_dest = dest;
+    reply.m_queryId = queryId;
+    reply.m_next = 0;
+    for (int i = 0; i < ranked.count(); i++)
+    {
+        int index = ranked[i].second;
+        reply.m_fileNames.append(fileNames[index]);
+        reply.m_fileIds.append(hashes[index]);
+        if (index < providers.count()) reply.m_providers.append(providers[index]);
+    }
+
+    sendReplyPage(reply);
+}
+
+void NetSocket::sendReplyPage(ReplyPages::Reply& reply)
 {
+    int end = ReplyPages::pageEnd(reply);
+    bool hasProviders = !reply.m_providers.isEmpty();
+
     QVariantList varFileNames;
     QVariantList varHashes;
-    for (int i = 0; i < fileNames.count(); i++)
+    QVariantList varProviders;
+    for (int i = reply.m_next; i < end; i++)
     {
-        varFileNames.append(fileNames[i]);
-        varHashes.append(hashes[i]);
+        varFileNames.append(reply.m_fileNames[i]);
+        varHashes.append(reply.m_fileIds[i]);
+        if (hasProviders) varProviders.append(reply.m_providers[i]);
+    }
+
+    PrivateSearchRep priv(reply.m_dest,
+                          10,
+                          reply.m_terms,
+                          varFileNames,
+                          varHashes,
+                          m_hostName);
+    priv.m_resultOrigins = varProviders;
+    priv.m_queryId = reply.m_queryId;
+
+    if (end < reply.m_fileNames.count())
+    {
+        reply.m_next = end;
+        priv.m_more = m_replyPages.add(reply);
     }
-    PrivateSearchRep priv(dest, 10, searchTerms, varFileNames, varHashes, m_hostName);
     sendPrivate(&priv);
 }
 
+void NetSocket::learnDirect(int originId, const AddrInfo& addr)
+{
+    QHash<int, qint64>::iterator failed = m_directFailed.find(originId);
+    if (failed != m_directFailed.end())
+    {
+        if (QDateTime::currentMSecsSinceEpoch() - failed.value() < DIRECT_RETRY_AFTER)
+        {
+            return;
+        }
+        m_directFailed.erase(failed);
+    }
+    m_directAddrs.insert(originId, addr);
+}
+
 void NetSocket::beginTrustChallenge(const QString& host,
                                     const QString& question,
                                     const QString& answer)
@@ -972,3 +1789,35 @@ void NetSocket::beginTrustChallenge(const QString& host,
     PrivateChallenge priv(host, 10, m_hostName, question);
     sendPrivate(&priv);
 }
+
+void NetSocket::checkNeighbors()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QVariantMap ping;
+    ping.insert(PING, true);
+
+    for (int i = 0; i < m_neighbors.count(); i++)
+    {
+        Monger* neighbor = m_neighbors.at(i);
+        if (neighbor->m_failed || now - neighbor->m_lastHeard < PROBE_AFTER)
+        {
+            continue;
+        }
+
+        bool failed = neighbor->m_answersProbes
+            ? neighbor->m_probes >= MAX_PROBES
+            : now - neighbor->m_lastHeard >= NEIGHBOR_TIMEOUT;
+        if (failed)
+        {
+            qDebug() << "Neighbor failed " << neighbor->m_addrInfo.m_addr.toString()
+                << ":" << neighbor->m_addrInfo.m_port;
+            neighbor->m_failed = true;
+            GlobalRoutes->dropNextHop(neighbor->m_addrInfo);
+        }
+        else if (neighbor->m_answersProbes || neighbor->m_probes < MAX_PROBES)
+        {
+            neighbor->m_probes++;
+            sendMap(ping, neighbor->m_addrInfo, SendQueue::Control);
+        }
+    }
+}
@@ -4,13 +4,22 @@
 #include <QUdpSocket>
 #include <QVariantMap>
 #include <QMap>
+#include <QHash>
 #include <QList>
-#include <QTimer>
 #include <QByteArray>
+#include <QPair>
 
 #include "messageinfo.hh"
 #include "addrinfo.hh"
 #include "Monger.hh"
+#include "NeighborTable.hh"
+#include "TimerWheel.hh"
+#include "QueryCache.hh"
+#include "SearchCache.hh"
+#include "ReplyPages.hh"
+#include "SendQueue.hh"
+#include "Admission.hh"
+#include "Fragmenter.hh"
 #include "PrivateMessage.hh"
 
 // Handles the network communication of peerster
@@ -26,7 +35,9 @@ public:
 
     void inputMessage(QString& message);
 
-    void sendToRandNeighbor(MessageInfo& mesInf);
+    // Pushes a rumor to fanout random neighbors. Route rumors are sent to all
+    // neighbors.
+    void sendToRandNeighbor(MessageInfo& mesInf, int fanout = 1);
     void sendMessage(MessageInfo& mesInf,
                      QHostAddress addresss,
                     int port,
@@ -36,28 +47,54 @@ public:
     // Send a chat private message originating from this node
     void sendPrivate(QString& dest, QString& chatText);
 
+    // Send a private message of any type
+    void sendPrivate(PrivateMessage* priv);
+
+    // Sends a search request with the given budget, split among neighbors.
+    // nonce identifies the search along with its origin; 0 means the
+    // request has no query ID. A cancel tells nodes to stop handling and
+    // forwarding the search's requests, and needs a nonce.
     void sendSearchRequest(QString& searchTerms,
                            int budget,
+                           quint32 nonce,
                            QString origin = QString(),
-                           QByteArray sig = QByteArray());
+                           QByteArray sig = QByteArray(),
+                           bool cancel = false);
+    // Sends a search reply to dest. providers holds the ORIGIN sharing each
+    // file, or is empty if this node shares all of them. queryId is the
+    // nonce of the request, echoed so the searcher can match the reply.
     void sendSearchReply(QString& searchTerms,
                          QList<QString>& fileNames,
                          QList<QByteArray>& hashes,
-                         QString& dest);
-
-    void addNeighbor(AddrInfo addrInfo);
+                         QList<QString>& providers,
+                         QString& dest,
+                         quint32 queryId);
+
+    // Adds a neighbor. Neighbors that aren't static were added because they
+    // sent us a message, and are evicted once they go silent. Returns NULL
+    // if there are already too many of them.
+    Monger* addNeighbor(AddrInfo addrInfo, bool isStatic = true);
     void addNeighbor(QString& hostPortStr);
 
+    // Updates timers after GlobalGossip's settings change
+    void applyGossipPolicy();
+
+    // Sets the rate bulk traffic to each neighbor is paced to, in bytes per
+    // second
+    void setPaceRate(int bytesPerSec) { m_sendQueue.setPaceRate(bytesPerSec); }
+
+    // Lets the reply to a request we're sending past admission control
+    void expectReply() { m_admission.expectReply(); }
+
     void noForward();
     bool m_forward;
 
-    void requestBlock(QByteArray& hash, QString& host);
-
     void beginTrustChallenge(const QString& host,
                              const QString& question,
                              const QString& answer);
 
     QString m_hostName;
+    int m_hostId;
 
 public slots:
     void gotReadyRead();
@@ -67,34 +104,111 @@ public slots:
     // sends a route rumor message to a random neighbor
     void sendRandRouteRumor();
 
+    // sends our file name summaries to every neighbor
+    void sendSummaries();
+
+    // probes neighbors that have gone quiet, and drops the routes through
+    // those that stopped answering
+    void checkNeighbors();
+
 signals:
     void messageReceived(MessageInfo& mesInf);
-    void gotSearchResult(QString& terms, QString& fileName, QByteArray& hash, QString& host);
+    // queryId is 0 if the reply didn't echo one
+    void gotSearchResult(quint32 queryId,
+                         QString& terms,
+                         QString& fileName,
+                         QByteArray& hash,
+                         QString& host);
 
 private:
-    // Send a private message of any type
-    void sendPrivate(PrivateMessage* priv);
+    // Forward a private message
     void sendPrivate(const QVariantMap& priv);
 
-    void sendMap(const QVariantMap& varMap, QHostAddress address, int port);
-    void sendMap(const QVariantMap& varMap, const AddrInfo& addr);
+    // Splits budget among the given neighbors as evenly as possible, giving
+    // leftover budget to random neighbors. Appends (neighbor, budget) pairs
+    // to allocOut.
+    void splitBudget(int budget,
+                     QList<Monger*> neighbors,
+                     QList<QPair<Monger*, int> >& allocOut);
+
+    // Sends the page of a search reply that starts at reply.m_next, keeping
+    // the rest for the searcher to fetch
+    void sendReplyPage(ReplyPages::Reply& reply);
+
+    // Forwards a private message for dest without deserializing it, by
+    // patching its header in place
+    void forwardPrivate(QByteArray& datagram,
+                        const QString& dest,
+                        int hopLimit,
+                        quint32 directIP,
+                        QHostAddress from,
+                        int fromPort);
+
+    // Queue a datagram on m_sendQueue in the given class
+    void sendMap(const QVariantMap& varMap,
+                 QHostAddress address,
+                 int port,
+                 SendQueue::Class cls = SendQueue::Interactive);
+    void sendDatagram(const QByteArray& datagram,
+                      QHostAddress address,
+                      int port,
+                      SendQueue::Class cls = SendQueue::Interactive);
+    void sendMap(const QVariantMap& varMap,
+                 const AddrInfo& addr,
+                 SendQueue::Class cls = SendQueue::Interactive);
+
+    // Records where a provider's replies came from, so block requests can
+    // be sent straight to it
+    void learnDirect(int originId, const AddrInfo& addr);
+
+    // Class of a relayed datagram, judged by its size since relays can't
+    // read what it carries
+    static SendQueue::Class relayClass(int size);
+
+    // Kind of a deserialized datagram, for admission control
+    Admission::Kind admissionKind(const QVariantMap& varMap);
+
+    NeighborTable m_neighbors;
+
+    // Search requests we've already handled
+    QueryCache m_seenQueries;
+
+    // Results of other nodes' files, used to answer searches for them
+    SearchCache m_searchCache;
+
+    // Search reply pages waiting to be fetched
+    ReplyPages m_replyPages;
+    QList<AddrInfo> m_pendingAddrs;
 
-    // finds the provided AddrInfo in m_neighborAddrs and returns a pointer to
-    // it, else returns NULL
-    Monger* findNeighbor(AddrInfo addrInfo);
+    // Outgoing datagrams waiting for their turn
+    SendQueue m_sendQueue;
 
-    QList<AddrInfo> m_neighborAddrs;
-    QList<Monger*> m_neighbors;
-    QList<AddrInfo> m_pendingAddrs;
+    // Rate limits on incoming datagrams
+    Admission m_admission;
+
+    // Splits large datagrams and reassembles them
+    Fragmenter m_fragmenter;
+
+    // Addresses block requests are sent to directly, keyed by origin ID
+    QHash<int, AddrInfo> m_directAddrs;
+
+    // When each direct address stopped working, in ms since the epoch
+    QHash<int, qint64> m_directFailed;
 
     int m_myPortMin, m_myPortMax, m_myPort;
     int m_seqNo;
 
     // timer for sending a status message to a random neighbor
-    QTimer* m_statusTimer;
+    MemberTimer<NetSocket> m_statusTimer;
 
     // timer for sending a route rumor message to a random neighbor
-    QTimer* m_routeTimer;
+    MemberTimer<NetSocket> m_routeTimer;
+
+    // timer for sending file name summaries to neighbors
+    MemberTimer<NetSocket> m_summaryTimer;
+
+    // timer for probing quiet neighbors
+    MemberTimer<NetSocket> m_livenessTimer;
 };
 
 extern NetSocket* GlobalSocket;
@@ -0,0 +1,14 @@
+#include "Origins.hh"
+
+OriginRegistry* GlobalOrigins;
+
+int OriginRegistry::intern(const QString& name)
+{
+    QHash<QString, int>::const_iterator it = m_ids.constFind(name);
+    if (it != m_ids.constEnd()) return it.value();
+
+    int id = m_names.count();
+    m_names.append(name);
+    m_ids.insert(name, id);
+    return id;
+}
@@ -0,0 +1,35 @@
+#ifndef ORIGINS_HH
+#define ORIGINS_HH
+
+#include <QString>
+#include <QHash>
+#include <QVector>
+
+// Maps ORIGIN names to dense integer IDs. Names are interned once when they
+// arrive from the network so that internal tables can be keyed by ID instead
+// of hashing and copying strings on every packet. IDs are never reused.
+class OriginRegistry
+{
+public:
+    OriginRegistry() { }
+
+    // Returns the ID of the given name, registering it if it's new
+    int intern(const QString& name);
+
+    // Returns the ID of the given name, or -1 if it was never registered
+    int find(const QString& name) const { return m_ids.value(name, -1); }
+
+    // Returns the name registered with the given ID
+    const QString& name(int id) const { return m_names[id]; }
+
+    // Number of registered names. Valid IDs are 0..count()-1.
+    int count() const { return m_names.count(); }
+
+private:
+    QHash<QString, int> m_ids;
+    QVector<QString> m_names;
+};
+
+extern OriginRegistry* GlobalOrigins;
+
+#endif // ORIGINS_HH
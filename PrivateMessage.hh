@@ -11,13 +11,15 @@ class PrivateMessage
 public:
     PrivateMessage(const QString& dest,
                    int hopLimit)
-        : m_dest(dest), m_hopLimit(hopLimit), m_origin()
+        : m_dest(dest), m_hopLimit(hopLimit), m_origin(),
+          m_directIP(0), m_directPort(0), m_directVerified(false), m_reqId(0)
     { }
 
     PrivateMessage(const QString& dest,
                    int hopLimit,
                    const QString& origin)
-        : m_dest(dest), m_hopLimit(hopLimit), m_origin(origin)
+        : m_dest(dest), m_hopLimit(hopLimit), m_origin(origin),
+          m_directIP(0), m_directPort(0), m_directVerified(false), m_reqId(0)
     { }
 
     virtual ~PrivateMessage() { }
@@ -29,15 +31,22 @@ public:
         BlockReq,
         BlockRep,
         SearchRep,
+        SearchMore,
         Challenge,
         ChallengeResponse,
         ChallengeSig,
         SignatureRequest,
-        SignatureResponse
+        SignatureResponse,
+        DhtStore,
+        DhtFind,
+        DhtFound
     };
 
     virtual PrivateType type() = 0;
 
+    // Called before a request is sent again because it got no reply
+    virtual void prepareRetry() { }
+
     QString m_dest;
     int m_hopLimit;
 
@@ -47,6 +56,22 @@ public:
     // ORIGIN value which may not be defined for incoming messages
     bool hasOrigin() { return !m_origin.isEmpty(); }
     QString m_origin;
+
+    // IPv4 address and port at which the ORIGIN of an incoming message can
+    // be reached directly, or 0 if unknown. An outgoing message with a direct
+    // address is sent straight there instead of along the route to dest.
+    bool hasDirect() { return m_directIP != 0 && m_directPort != 0; }
+    quint32 m_directIP;
+    quint16 m_directPort;
+
+    // True if the direct address of an incoming message is the address it
+    // came from, rather than one recorded by a relay. Only such an address
+    // is safe to send replies to, since a relay can record any address.
+    bool m_directVerified;
+
+    // ID of a request sent through GlobalRpc, echoed by its reply; 0 if
+    // the message isn't part of a call
+    quint32 m_reqId;
 };
 
 // Holds content of a trust challenge message
@@ -174,10 +199,17 @@ public:
                     int hopLimit,
                     const QByteArray& hash,
                     const QString& origin)
-        : PrivateBlockMessage(dest, hopLimit, hash, origin)
+        : PrivateBlockMessage(dest, hopLimit, hash, origin), m_relay(false)
     { }
 
     PrivateType type() { return BlockReq; }
+
+    // A direct reply may be what got lost, so retries ask for the route
+    void prepareRetry() { m_relay = true; }
+
+    // True if the reply must follow the route rather than go directly to
+    // the origin, e.g. because a direct reply already got lost
+    bool m_relay;
 };
 
 // Holds content of a block reply message
@@ -210,7 +242,9 @@ public:
         : PrivateMessage(dest, hopLimit, origin),
           m_searchTerms(searchTerms),
           m_resultFileNames(resultFileNames),
-          m_resultHashes(resultHashes)
+          m_resultHashes(resultHashes),
+          m_queryId(0),
+          m_more(0)
     { }
 
     PrivateType type() { return SearchRep; }
@@ -218,6 +252,108 @@ public:
     QString m_searchTerms;
     QVariantList m_resultFileNames;
     QVariantList m_resultHashes;
+
+    // ORIGIN of the node sharing each result, for results the sender answered
+    // from its cache. Empty if every result is shared by the sender.
+    QVariantList m_resultOrigins;
+
+    // Nonce of the request being answered, or 0 if it had none
+    quint32 m_queryId;
+
+    // Continuation token for fetching the next page of results with a
+    // PrivateSearchMore, or 0 if this is the last page
+    quint32 m_more;
+};
+
+// Asks a node that sent a search reply for the next page of results
+class PrivateSearchMore : public PrivateMessage
+{
+public:
+    PrivateSearchMore(const QString& dest,
+                      int hopLimit,
+                      const QString& origin,
+                      quint32 token)
+        : PrivateMessage(dest, hopLimit, origin), m_token(token)
+    { }
+
+    PrivateType type() { return SearchMore; }
+
+    quint32 m_token;
+};
+
+// Asks the destination to store provider records under a DHT key. The
+// origin is the provider of every file listed.
+class PrivateDhtStore : public PrivateMessage
+{
+public:
+    PrivateDhtStore(const QString& dest,
+                    int hopLimit,
+                    const QString& origin,
+                    const QByteArray& key,
+                    const QVariantList& fileNames,
+                    const QVariantList& fileIds)
+        : PrivateMessage(dest, hopLimit, origin),
+          m_key(key),
+          m_fileNames(fileNames),
+          m_fileIds(fileIds)
+    { }
+
+    PrivateType type() { return DhtStore; }
+
+    QByteArray m_key;
+    QVariantList m_fileNames;
+    QVariantList m_fileIds;
+};
+
+// Asks the destination for the nodes it knows closest to a DHT key and the
+// records it stores under it
+class PrivateDhtFind : public PrivateMessage
+{
+public:
+    PrivateDhtFind(const QString& dest,
+                   int hopLimit,
+                   const QString& origin,
+                   const QByteArray& key,
+                   quint32 lookupId)
+        : PrivateMessage(dest, hopLimit, origin),
+          m_key(key),
+          m_lookupId(lookupId)
+    { }
+
+    PrivateType type() { return DhtFind; }
+
+    QByteArray m_key;
+
+    // Identifies the lookup at the requester
+    quint32 m_lookupId;
+};
+
+// Reply to a PrivateDhtFind
+class PrivateDhtFound : public PrivateMessage
+{
+public:
+    PrivateDhtFound(const QString& dest,
+                    int hopLimit,
+                    const QString& origin,
+                    const QByteArray& key,
+                    quint32 lookupId)
+        : PrivateMessage(dest, hopLimit, origin),
+          m_key(key),
+          m_lookupId(lookupId)
+    { }
+
+    PrivateType type() { return DhtFound; }
+
+    QByteArray m_key;
+    quint32 m_lookupId;
+
+    // ORIGINs of the closest nodes the sender knows
+    QVariantList m_nodes;
+
+    // Records stored under the key, as parallel lists
+    QVariantList m_fileNames;
+    QVariantList m_fileIds;
+    QVariantList m_providers;
 };
 
 #endif // PRIVATEMESSAGE_HH
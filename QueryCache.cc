@@ -0,0 +1,43 @@
+#include <QDateTime>
+
+#include "QueryCache.hh"
+
+// Maximum number of queries remembered
+#define MAX_QUERIES (4096)
+
+// ms after which a query is forgotten
+#define QUERY_TTL (60000)
+
+QueryCache::Entry& QueryCache::lookup(int originId, quint32 nonce, bool* isNew)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    expire(now);
+
+    QueryId id = qMakePair(originId, nonce);
+    QHash<QueryId, Entry>::iterator it = m_entries.find(id);
+    if (it != m_entries.end())
+    {
+        *isNew = false;
+        return it.value();
+    }
+
+    *isNew = true;
+    if (m_order.count() >= MAX_QUERIES)
+    {
+        m_entries.remove(m_order.dequeue());
+    }
+
+    Entry entry;
+    entry.m_seen = now;
+    m_order.enqueue(id);
+    return m_entries.insert(id, entry).value();
+}
+
+void QueryCache::expire(qint64 now)
+{
+    while (!m_order.isEmpty()
+           && m_entries.value(m_order.head()).m_seen < now - QUERY_TTL)
+    {
+        m_entries.remove(m_order.dequeue());
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef QUERY_CACHE_HH
+#define QUERY_CACHE_HH
+
+#include <QHash>
+#include <QQueue>
+#include <QPair>
+
+// Bounded cache of the flooded search requests this node has seen, keyed by
+// query ID: the ORIGIN of the request and the nonce it picked for the
+// search. Entries expire after a while and the oldest entries are dropped
+// once the cache is full.
+class QueryCache
+{
+public:
+    QueryCache() { }
+
+    struct Entry
+    {
+        Entry() : m_handled(false), m_cancelled(false), m_seen(0) { }
+
+        // True if we've matched the query against our files and sent the
+        // origin any reply
+        bool m_handled;
+
+        // True if the origin canceled the search. Requests for it are
+        // dropped instead of forwarded.
+        bool m_cancelled;
+
+        // Time the query was first seen, in ms since the epoch
+        qint64 m_seen;
+    };
+
+    // Returns the entry for the query, creating it if it's new. Sets isNew
+    // to true if the query wasn't in the cache.
+    Entry& lookup(int originId, quint32 nonce, bool* isNew);
+
+private:
+    typedef QPair<int, quint32> QueryId;
+
+    void expire(qint64 now);
+
+    QHash<QueryId, Entry> m_entries;
+
+    // Query IDs in the order they were first seen
+    QQueue<QueryId> m_order;
+};
+
+#endif // QUERY_CACHE_HH
@@ -0,0 +1,84 @@
+#include <QDateTime>
+
+#include "ReplyPages.hh"
+
+// Most result bytes in a page. With the encryption, signature and header
+// overhead of a private message, a page stays within a 1500-byte Ethernet
+// MTU.
+#define SEARCH_PAGE_BYTES (900)
+
+// Estimated serialization overhead of each result beyond its contents
+#define RESULT_OVERHEAD (24)
+
+// Most replies with pages left to fetch
+#define MAX_REPLIES (256)
+
+// ms a searcher has to fetch the next page
+#define REPLY_TTL (60000)
+
+int ReplyPages::pageEnd(const Reply& reply)
+{
+    int count = qMin(reply.m_fileNames.count(), reply.m_fileIds.count());
+    int bytes = 0;
+    int end = reply.m_next;
+    while (end < count)
+    {
+        int resultBytes = RESULT_OVERHEAD
+            + reply.m_fileNames[end].toString().toUtf8().size()
+            + reply.m_fileIds[end].toByteArray().size();
+        if (end < reply.m_providers.count())
+        {
+            resultBytes += reply.m_providers[end].toString().toUtf8().size();
+        }
+
+        if (end > reply.m_next && bytes + resultBytes > SEARCH_PAGE_BYTES) break;
+        bytes += resultBytes;
+        end++;
+    }
+    return end;
+}
+
+quint32 ReplyPages::add(const Reply& reply)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    expire(now);
+
+    if (m_order.count() >= MAX_REPLIES)
+    {
+        m_replies.remove(m_order.dequeue());
+    }
+
+    quint32 token;
+    do
+    {
+        token = ((quint32)rand() << 16) ^ (quint32)rand();
+    } while (token == 0 || m_replies.contains(token));
+
+    Reply stored = reply;
+    stored.m_expires = now + REPLY_TTL;
+    m_replies.insert(token, stored);
+    m_order.enqueue(token);
+    return token;
+}
+
+bool ReplyPages::take(quint32 token, const QString& requester, Reply& replyOut)
+{
+    expire(QDateTime::currentMSecsSinceEpoch());
+
+    QHash<quint32, Reply>::iterator it = m_replies.find(token);
+    if (it == m_replies.end() || it.value().m_dest != requester) return false;
+
+    replyOut = it.value();
+    m_replies.erase(it);
+    m_order.removeOne(token);
+    return true;
+}
+
+void ReplyPages::expire(qint64 now)
+{
+    while (!m_order.isEmpty()
+           && m_replies.value(m_order.head()).m_expires < now)
+    {
+        m_replies.remove(m_order.dequeue());
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef REPLY_PAGES_HH
+#define REPLY_PAGES_HH
+
+#include <QString>
+#include <QVariantList>
+#include <QHash>
+#include <QQueue>
+
+// Search replies are sent a page at a time so that each page fits in a
+// datagram. This holds the results that haven't been sent yet, keyed by the
+// continuation token the searcher uses to fetch the next page. Entries
+// expire after a while and the oldest are dropped once the store is full.
+class ReplyPages
+{
+public:
+    ReplyPages() { }
+
+    struct Reply
+    {
+        QString m_terms;
+
+        // ORIGIN of the searcher; only it may fetch the pages
+        QString m_dest;
+        quint32 m_queryId;
+
+        // Results, as parallel lists. m_providers is empty if this node
+        // shares all of the files.
+        QVariantList m_fileNames;
+        QVariantList m_fileIds;
+        QVariantList m_providers;
+
+        // Index of the first result not yet sent
+        int m_next;
+
+        // Time the reply expires, in ms since the epoch
+        qint64 m_expires;
+    };
+
+    // Returns the index after the last result of the page that starts at
+    // reply.m_next. A page holds at least one result.
+    static int pageEnd(const Reply& reply);
+
+    // Stores a reply with results left to send. Returns its continuation
+    // token.
+    quint32 add(const Reply& reply);
+
+    // Removes and returns the reply for token. Returns false if there is no
+    // such reply or it belongs to another searcher.
+    bool take(quint32 token, const QString& requester, Reply& replyOut);
+
+private:
+    void expire(qint64 now);
+
+    QHash<quint32, Reply> m_replies;
+
+    // Tokens in the order they were added
+    QQueue<quint32> m_order;
+};
+
+#endif // REPLY_PAGES_HH
@@ -1,17 +1,60 @@
 #include <QDebug>
+#include <QDateTime>
 
 #include "RouteTable.hh"
 #include "ChatDialog.hh"
 
+// Most candidate next hops kept per origin
+#define MAX_CANDIDATES (4)
+
+// Cost of a hop in ms, for candidates without an RTT sample
+#define HOP_COST (50)
+
+// A candidate that hasn't carried any of the last few route rumors may be
+// broken, and is only used when nothing fresher is left
+#define STALE_SEQS (2)
+#define STALE_COST (1000000)
+
+// A candidate must be this many percent cheaper than the current next hop
+// to replace it
+#define HYSTERESIS_PERCENT (20)
+
+// Requests older than this many ms are assumed lost
+#define REQUEST_TIMEOUT (10000)
+#define MAX_REQUESTS (1024)
+
+// Bulk traffic uses next hops costing at most this many times the best
+#define BULK_SPREAD (3)
+
+// Weight of a new sample in the smoothed loss rate
+#define LOSS_GAIN (0.125)
+
+// Next hops expire after this many ms without carrying a rumor. Route
+// rumors go to every neighbor once a minute, so this allows for two lost.
+#define ROUTE_TTL (180000)
+#define EXPIRY_INTERVAL (5000)
+
 RouteTable* GlobalRoutes;
 
-bool RouteTable::getNextHop(QString& dest, AddrInfo& nextHopOut)
+RouteTable::RouteTable()
+    : m_expiryTimer(this, &RouteTable::expireRoutes)
 {
-    if (m_table.contains(dest))
+    m_expiryTimer.startRepeating(EXPIRY_INTERVAL);
+}
+
+bool RouteTable::getNextHop(const QString& dest, AddrInfo& nextHopOut)
+{
+    return getNextHop(GlobalOrigins->find(dest), nextHopOut);
+}
+
+bool RouteTable::getNextHop(int destId, AddrInfo& nextHopOut)
+{
+    if (destId >= 0 && destId < m_table.count() && m_table[destId].m_best >= 0)
     {
+        const RouteEntry& entry = m_table[destId];
         nextHopOut.m_isDns = false;
-        nextHopOut.m_addr = m_table[dest].second.m_addr;
-        nextHopOut.m_port = m_table[dest].second.m_port;
+        nextHopOut.m_addr = entry.m_candidates[entry.m_best].m_nextHop.m_addr;
+        nextHopOut.m_port = entry.m_candidates[entry.m_best].m_nextHop.m_port;
         return true;
     }
     else
@@ -20,6 +63,49 @@ bool RouteTable::getNextHop(QString& dest, AddrInfo& nextHopOut)
     }
 }
 
+bool RouteTable::getBulkHop(const QString& dest, AddrInfo& nextHopOut)
+{
+    int destId = GlobalOrigins->find(dest);
+    if (destId < 0 || destId >= m_table.count() || m_table[destId].m_best < 0)
+    {
+        return false;
+    }
+
+    RouteEntry& entry = m_table[destId];
+    qint64 bestCost = cost(entry, entry.m_candidates[entry.m_best]);
+
+    // Smooth weighted round robin: every usable next hop earns credit in
+    // proportion to its weight, and the richest one is picked and pays for
+    // the round
+    int pick = -1;
+    double total = 0;
+    for (int i = 0; i < entry.m_candidates.count(); i++)
+    {
+        Candidate& candidate = entry.m_candidates[i];
+        qint64 metric = cost(entry, candidate);
+        if (i != entry.m_best && metric > bestCost * BULK_SPREAD) continue;
+
+        double weight = (1.0 - candidate.m_loss) / qMax((qint64)1, metric);
+        if (weight <= 0) continue;
+
+        candidate.m_credit += weight;
+        total += weight;
+        if (pick < 0 || candidate.m_credit > entry.m_candidates[pick].m_credit)
+        {
+            pick = i;
+        }
+    }
+
+    // Every path is losing everything; stick to the route
+    if (pick < 0) pick = entry.m_best;
+    entry.m_candidates[pick].m_credit -= total;
+
+    nextHopOut.m_isDns = false;
+    nextHopOut.m_addr = entry.m_candidates[pick].m_nextHop.m_addr;
+    nextHopOut.m_port = entry.m_candidates[pick].m_nextHop.m_port;
+    return true;
+}
+
 void RouteTable::addRoute(MessageInfo& mesInf, AddrInfo& addr, bool isDirectHop)
 {
     if (addr.m_isDns)
@@ -27,33 +113,252 @@ void RouteTable::addRoute(MessageInfo& mesInf, AddrInfo& addr, bool isDirectHop)
         qDebug() << "Attempting to add route with only DNS address";
     }
 
-    bool update = false;
+    int originId = mesInf.m_originId;
+    if (originId >= m_table.count()) m_table.resize(originId + 1);
+    RouteEntry& entry = m_table[originId];
+
+    // Older peersters don't send hop counts; all we know is whether the
+    // rumor came straight from its origin
+    int hops = mesInf.m_hops > 0 ? mesInf.m_hops : (isDirectHop ? 1 : 2);
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    int index;
+    for (index = 0; index < entry.m_candidates.count(); index++)
+    {
+        if (entry.m_candidates[index].m_nextHop == addr) break;
+    }
+
+    if (index == entry.m_candidates.count())
+    {
+        Candidate candidate;
+        candidate.m_nextHop = addr;
+        candidate.m_seqNo = mesInf.m_seqNo;
+        candidate.m_hops = hops;
+        candidate.m_lastHeard = now;
+
+        if (entry.m_candidates.count() < MAX_CANDIDATES)
+        {
+            entry.m_candidates.append(candidate);
+        }
+        else
+        {
+            // Replace the worst candidate other than the one in use, if the
+            // new one is better
+            int worst = -1;
+            for (int i = 0; i < entry.m_candidates.count(); i++)
+            {
+                if (i == entry.m_best) continue;
+                if (worst < 0
+                    || cost(entry, entry.m_candidates[i]) > cost(entry, entry.m_candidates[worst]))
+                {
+                    worst = i;
+                }
+            }
+            if (cost(entry, candidate) >= cost(entry, entry.m_candidates[worst])) return;
+            entry.m_candidates[worst] = candidate;
+            index = worst;
+        }
+    }
+    else
+    {
+        Candidate& candidate = entry.m_candidates[index];
+        if (mesInf.m_seqNo > candidate.m_seqNo)
+        {
+            candidate.m_seqNo = mesInf.m_seqNo;
+            candidate.m_hops = hops;
+            candidate.m_lastHeard = now;
+        }
+        else if (mesInf.m_seqNo == candidate.m_seqNo)
+        {
+            candidate.m_hops = qMin(candidate.m_hops, hops);
+            candidate.m_lastHeard = now;
+        }
+    }
+
+    entry.m_newestSeqNo = qMax(entry.m_newestSeqNo, mesInf.m_seqNo);
 
     // update GUI if we're adding a route for the first time
-    if (!m_table.contains(mesInf.m_host))
+    if (!entry.m_announced)
     {
-        qDebug() << "Adding route for " << mesInf.m_host;
-        GlobalChatDialog->addOriginForPrivates(mesInf.m_host);
+        qDebug() << "Adding route for " << mesInf.host();
+        QString host = mesInf.host();
+        GlobalChatDialog->addOriginForPrivates(host);
+        entry.m_announced = true;
+    }
 
-        update = true;
+    choose(entry);
+}
+
+qint64 RouteTable::cost(const RouteEntry& entry, const Candidate& candidate)
+{
+    qint64 metric = candidate.m_srtt > 0
+        ? candidate.m_srtt : (qint64)candidate.m_hops * HOP_COST;
+
+    if (candidate.m_seqNo < entry.m_newestSeqNo - STALE_SEQS)
+    {
+        metric += STALE_COST;
     }
-    else if (mesInf.m_seqNo > m_table[mesInf.m_host].first
-             || (mesInf.m_seqNo == m_table[mesInf.m_host].first
-                 && isDirectHop))
+    return metric;
+}
+
+void RouteTable::choose(RouteEntry& entry)
+{
+    int best = -1;
+    for (int i = 0; i < entry.m_candidates.count(); i++)
+    {
+        if (best < 0 || cost(entry, entry.m_candidates[i]) < cost(entry, entry.m_candidates[best]))
+        {
+            best = i;
+        }
+    }
+
+    if (best < 0 || best == entry.m_best) return;
+
+    if (entry.m_best >= 0)
     {
-        qDebug() << "Editing route for " << mesInf.m_host;
+        qint64 current = cost(entry, entry.m_candidates[entry.m_best]);
+        qint64 better = cost(entry, entry.m_candidates[best]);
+        if (better * 100 > current * (100 - HYSTERESIS_PERCENT)) return;
+    }
+
+    const Candidate& chosen = entry.m_candidates[best];
+    qDebug() << "Using next hop " << chosen.m_nextHop.m_addr.toString() << ":"
+        << chosen.m_nextHop.m_port << ", hops: " << chosen.m_hops
+        << ", srtt: " << chosen.m_srtt;
+    entry.m_best = best;
+}
+
+void RouteTable::sentRequest(int destId, const QByteArray& key, const AddrInfo& nextHop)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    // Forget requests whose replies are lost
+    while (!m_requestOrder.isEmpty()
+           && (m_requestOrder.count() >= MAX_REQUESTS
+               || m_requests.value(m_requestOrder.head()).m_sent < now - REQUEST_TIMEOUT))
+    {
+        RequestId lost = m_requestOrder.dequeue();
+        QHash<RequestId, Request>::iterator it = m_requests.find(lost);
+        if (it == m_requests.end()) continue;
+        recordDelivery(lost.first, it.value().m_nextHop, false);
+        m_requests.erase(it);
+    }
 
-        if (isDirectHop)
+    // A request sent again before its reply came means the first was lost
+    RequestId id = qMakePair(destId, key);
+    QHash<RequestId, Request>::iterator it = m_requests.find(id);
+    if (it == m_requests.end())
+    {
+        m_requestOrder.enqueue(id);
+    }
+    else
+    {
+        recordDelivery(destId, it.value().m_nextHop, false);
+    }
+
+    Request request;
+    request.m_sent = now;
+    request.m_nextHop = nextHop;
+    m_requests.insert(id, request);
+}
+
+void RouteTable::gotReply(int destId, const QByteArray& key)
+{
+    QHash<RequestId, Request>::iterator it = m_requests.find(qMakePair(destId, key));
+    if (it == m_requests.end()) return;
+
+    qint64 rtt = QDateTime::currentMSecsSinceEpoch() - it.value().m_sent;
+    AddrInfo nextHop = it.value().m_nextHop;
+    m_requests.erase(it);
+
+    recordDelivery(destId, nextHop, true);
+
+    Candidate* candidate = findCandidate(destId, nextHop);
+    if (candidate)
+    {
+        candidate->m_srtt = candidate->m_srtt > 0
+            ? (7 * candidate->m_srtt + rtt) / 8 : qMax((qint64)1, rtt);
+        choose(m_table[destId]);
+    }
+}
+
+void RouteTable::dropNextHop(const AddrInfo& nextHop)
+{
+    AddrInfo dead = nextHop;
+    int dropped = 0;
+    for (int id = 0; id < m_table.count(); id++)
+    {
+        RouteEntry& entry = m_table[id];
+        for (int i = entry.m_candidates.count() - 1; i >= 0; i--)
+        {
+            if (entry.m_candidates[i].m_nextHop == dead)
+            {
+                removeCandidate(entry, i);
+                dropped++;
+            }
+        }
+    }
+
+    if (dropped > 0)
+    {
+        qDebug() << "Dropped " << dropped << " routes through "
+            << dead.m_addr.toString() << ":" << dead.m_port;
+    }
+}
+
+void RouteTable::removeCandidate(RouteEntry& entry, int index)
+{
+    entry.m_candidates.removeAt(index);
+    if (index == entry.m_best)
+    {
+        // Without a next hop in use there's nothing to be sticky about, so
+        // choose takes the best one left
+        entry.m_best = -1;
+        choose(entry);
+    }
+    else if (index < entry.m_best)
+    {
+        entry.m_best--;
+    }
+}
+
+void RouteTable::expireRoutes()
+{
+    qint64 oldest = QDateTime::currentMSecsSinceEpoch() - ROUTE_TTL;
+    for (int id = 0; id < m_table.count(); id++)
+    {
+        RouteEntry& entry = m_table[id];
+        for (int i = entry.m_candidates.count() - 1; i >= 0; i--)
         {
-            qDebug() << "Got a DIRECT HOP for " << mesInf.m_host;
+            if (entry.m_candidates[i].m_lastHeard < oldest)
+            {
+                removeCandidate(entry, i);
+                if (entry.m_best < 0)
+                {
+                    qDebug() << "Route expired for " << GlobalOrigins->name(id);
+                }
+            }
         }
+    }
+}
+
+RouteTable::Candidate* RouteTable::findCandidate(int destId, const AddrInfo& nextHop)
+{
+    if (destId < 0 || destId >= m_table.count()) return 0;
 
-        update = true;
+    QList<Candidate>& candidates = m_table[destId].m_candidates;
+    for (int i = 0; i < candidates.count(); i++)
+    {
+        if (candidates[i].m_nextHop == nextHop) return &candidates[i];
     }
+    return 0;
+}
 
-    if (update)
+void RouteTable::recordDelivery(int destId, const AddrInfo& nextHop, bool delivered)
+{
+    Candidate* candidate = findCandidate(destId, nextHop);
+    if (candidate)
     {
-        m_directHop[mesInf.m_host] = isDirectHop;
-        m_table[mesInf.m_host] = qMakePair(mesInf.m_seqNo, addr);
+        candidate->m_loss += LOSS_GAIN * ((delivered ? 0.0 : 1.0) - candidate->m_loss);
     }
 }
@@ -2,36 +2,145 @@
 #define ROUTE_TABLE_HH
 
 #include <QObject>
+#include <QVector>
+#include <QList>
 #include <QHash>
+#include <QQueue>
 #include <QPair>
+#include <QByteArray>
 
 #include "messageinfo.hh"
 #include "addrinfo.hh"
+#include "TimerWheel.hh"
 
+// Routes to every ORIGIN we've heard rumors from. Each origin keeps a few
+// candidate next hops, learned from the rumors that arrive through them,
+// and uses the one with the best metric: the smoothed round-trip time of
+// private requests routed through it if we've measured one, or else its
+// hop count. A better candidate only replaces the current next hop if it's
+// better by a clear margin, so routes don't flap between similar paths.
+// Bulk traffic is spread over every candidate that isn't much worse than
+// the best, by weighted round robin. Next hops that stop carrying rumors
+// expire, and next hops through a neighbor that failed are dropped at once.
 class RouteTable : public QObject
 {
     Q_OBJECT
 
 public:
+    RouteTable();
+
     // Finds the address and port of the next hop needed to reach the host with
     // the ORIGIN value dest. Puts this address and port in nextHopOut if it
     // exists; else doesn't touch nextHopOut. Returns true if the address is
     // found; else returns false.
-    bool getNextHop(QString& dest, AddrInfo& nextHopOut);
+    bool getNextHop(const QString& dest, AddrInfo& nextHopOut);
+    bool getNextHop(int destId, AddrInfo& nextHopOut);
+
+    // Like getNextHop, but picks among the good next hops to dest in turn,
+    // in proportion to their speed and delivery rate. Used for block
+    // requests and replies.
+    bool getBulkHop(const QString& dest, AddrInfo& nextHopOut);
+
+    // Records that a private request identified by key was routed to destId
+    // via nextHop, so that its reply gives an RTT sample
+    void sentRequest(int destId, const QByteArray& key, const AddrInfo& nextHop);
+
+    // Records the reply to a request passed to sentRequest. Requests without
+    // a reply in time count as lost on the next hop they were sent to.
+    void gotReply(int destId, const QByteArray& key);
+
+    // Drops every route through nextHop, after the neighbor there failed
+    void dropNextHop(const AddrInfo& nextHop);
 
 public slots:
-    // Adds or edits a route in the routing table
+    // Adds or updates a route in the routing table from a rumor that arrived
+    // from addr. mesInf.m_hops is the rumor's distance from its origin.
     void addRoute(MessageInfo& mesInf, AddrInfo& addr, bool isDirectHop);
 
 private:
-    // Contains routing info. Keyed by ORIGIN value.
-    // Values contain the seqNo of the message that gave the most recent
-    // route and the next hop.
-    QHash<QString, QPair<int, AddrInfo> > m_table;
-
-    // Keyed by ORIGIN value. Indicates whether the route info for the ORIGIN
-    // is a direct hop or not.
-    QHash<QString, bool> m_directHop;
+    // A possible next hop for an origin
+    struct Candidate
+    {
+        Candidate()
+            : m_seqNo(0), m_hops(0), m_srtt(0), m_loss(0), m_credit(0), m_lastHeard(0) { }
+
+        AddrInfo m_nextHop;
+
+        // seqNo of the newest rumor that arrived through this next hop
+        int m_seqNo;
+
+        // Hops to the origin through this next hop
+        int m_hops;
+
+        // Smoothed RTT to the origin through this next hop in ms, or 0 if
+        // not measured yet
+        qint64 m_srtt;
+
+        // Smoothed fraction of requests through this next hop that got no
+        // reply
+        double m_loss;
+
+        // Weighted round robin state for bulk traffic
+        double m_credit;
+
+        // Time a current rumor last arrived through this next hop, in ms
+        // since the epoch
+        qint64 m_lastHeard;
+    };
+
+    // Routing info for a single ORIGIN
+    struct RouteEntry
+    {
+        RouteEntry() : m_best(-1), m_newestSeqNo(0), m_announced(false) { }
+
+        QList<Candidate> m_candidates;
+
+        // Index of the next hop in use, or -1 if we have no route
+        int m_best;
+
+        // seqNo of the newest rumor from the origin through any next hop
+        int m_newestSeqNo;
+
+        // True once the origin has been added to the GUI
+        bool m_announced;
+    };
+
+    // A private request waiting for its reply
+    struct Request
+    {
+        Request() : m_sent(0) { }
+
+        qint64 m_sent;
+        AddrInfo m_nextHop;
+    };
+    typedef QPair<int, QByteArray> RequestId;
+
+    // Metric of a candidate; lower is better
+    qint64 cost(const RouteEntry& entry, const Candidate& candidate);
+
+    // Picks the next hop for an origin, with hysteresis
+    void choose(RouteEntry& entry);
+
+    // Removes a candidate, picking a new next hop if it was in use
+    void removeCandidate(RouteEntry& entry, int index);
+
+    // Removes candidates that haven't carried a rumor within the route TTL
+    void expireRoutes();
+
+    // Returns the candidate for an origin using nextHop, or 0 if none
+    Candidate* findCandidate(int destId, const AddrInfo& nextHop);
+
+    // Records whether a request sent through nextHop got its reply
+    void recordDelivery(int destId, const AddrInfo& nextHop, bool delivered);
+
+    // Contains routing info. Indexed by origin ID.
+    QVector<RouteEntry> m_table;
+
+    // Requests waiting for replies, and their IDs in the order they were sent
+    QHash<RequestId, Request> m_requests;
+    QQueue<RequestId> m_requestOrder;
+
+    MemberTimer<RouteTable> m_expiryTimer;
 };
 
 extern RouteTable* GlobalRoutes;
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+
+#include <QDebug>
+
+#include "Rpc.hh"
+#include "NetSocket.hh"
+
+// ms to wait for the first reply; each retry waits twice as long as the
+// last, up to MAX_TIMEOUT
+#define FIRST_TIMEOUT (2000)
+#define MAX_TIMEOUT (16000)
+
+Rpc* GlobalRpc;
+
+Rpc::Rpc()
+{
+    m_nextId = rand();
+    m_reporting = NULL;
+}
+
+Rpc::~Rpc()
+{
+    QHash<quint32, Call*>::iterator it;
+    for (it = m_calls.begin(); it != m_calls.end(); ++it)
+    {
+        delete it.value()->m_request;
+        delete it.value();
+    }
+}
+
+quint32 Rpc::call(PrivateMessage* request,
+                  const QByteArray& key,
+                  RpcCaller* caller,
+                  int tries)
+{
+    QByteArray fullKey = request->m_dest.toUtf8();
+    fullKey.append('\0');
+    fullKey.append(key);
+
+    Call* existing = m_byKey.value(fullKey, NULL);
+    if (existing)
+    {
+        // The same request is already in flight; wait for its reply
+        if (caller && !existing->m_callers.contains(caller))
+        {
+            existing->m_callers.append(caller);
+        }
+        delete request;
+        return existing->m_id;
+    }
+
+    // 0 means a message has no request ID
+    if (m_nextId == 0) m_nextId++;
+    while (m_calls.contains(m_nextId)) m_nextId++;
+
+    Call* call = new Call(this);
+    call->m_id = m_nextId++;
+    call->m_key = fullKey;
+    call->m_request = request;
+    if (caller) call->m_callers.append(caller);
+    call->m_triesLeft = tries - 1;
+    call->m_timeout = FIRST_TIMEOUT;
+    call->m_timer.start(FIRST_TIMEOUT);
+    m_calls.insert(call->m_id, call);
+    m_byKey.insert(fullKey, call);
+
+    request->m_reqId = call->m_id;
+    GlobalSocket->expectReply();
+    GlobalSocket->sendPrivate(request);
+    return call->m_id;
+}
+
+bool Rpc::reply(PrivateMessage* reply)
+{
+    if (reply->m_reqId == 0) return false;
+
+    Call* call = m_calls.value(reply->m_reqId, NULL);
+    if (!call) return false;
+
+    // Only the node the request went to may answer it
+    if (reply->m_origin != call->m_request->m_dest) return false;
+
+    finish(call, reply);
+    return true;
+}
+
+void Rpc::cancel(RpcCaller* caller)
+{
+    QHash<quint32, Call*>::iterator it;
+    for (it = m_calls.begin(); it != m_calls.end(); ++it)
+    {
+        it.value()->m_callers.removeAll(caller);
+    }
+
+    if (m_reporting)
+    {
+        for (int i = 0; i < m_reporting->count(); i++)
+        {
+            if ((*m_reporting)[i] == caller) (*m_reporting)[i] = NULL;
+        }
+    }
+}
+
+void Rpc::timedOut(Call* call)
+{
+    if (call->m_triesLeft <= 0)
+    {
+        qDebug() << "Request " << call->m_id << " to " << call->m_request->m_dest
+            << " got no reply";
+        finish(call, NULL);
+        return;
+    }
+
+    call->m_triesLeft--;
+    call->m_timeout = qMin(call->m_timeout * 2, MAX_TIMEOUT);
+    call->m_timer.start(call->m_timeout);
+    call->m_request->prepareRetry();
+    GlobalSocket->expectReply();
+    GlobalSocket->sendPrivate(call->m_request);
+}
+
+void Rpc::finish(Call* call, PrivateMessage* reply)
+{
+    m_calls.remove(call->m_id);
+    m_byKey.remove(call->m_key);
+
+    // Callers may make new calls or cancel each other while being told
+    QList<RpcCaller*> callers = call->m_callers;
+    QList<RpcCaller*>* outer = m_reporting;
+    m_reporting = &callers;
+
+    QByteArray key = call->m_key.mid(call->m_key.indexOf('\0') + 1);
+    for (int i = 0; i < callers.count(); i++)
+    {
+        if (!callers[i]) continue;
+        if (reply) callers[i]->replied(key, reply);
+        else callers[i]->failed(key);
+    }
+
+    m_reporting = outer;
+    delete call->m_request;
+    delete call;
+}
@@ -0,0 +1,94 @@
+#ifndef RPC_HH
+#define RPC_HH
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+
+#include "PrivateMessage.hh"
+#include "TimerWheel.hh"
+
+// Receives the outcome of calls made through GlobalRpc
+class RpcCaller
+{
+public:
+    virtual ~RpcCaller() { }
+
+    // Called with the reply to a call made with the given key. The reply is
+    // deleted after this returns.
+    virtual void replied(const QByteArray& key, PrivateMessage* reply) = 0;
+
+    // Called when a call made with the given key got no reply after all of
+    // its tries
+    virtual void failed(const QByteArray& key) = 0;
+};
+
+// Request/reply layer over private messages. Each request carries a request
+// ID ("ReqId") that its reply echoes. Requests are resent with exponential
+// backoff until they get a reply or run out of tries. Calls for the same key
+// and destination while one is in flight join it instead of sending another
+// request, so any number of callers can keep many requests outstanding to a
+// peer cheaply.
+class Rpc
+{
+public:
+    Rpc();
+    ~Rpc();
+
+    // Sends request, taking ownership of it, and reports its reply or
+    // failure to caller, which may be NULL. key identifies requests that
+    // are the same, along with the destination. Returns the request ID.
+    quint32 call(PrivateMessage* request,
+                 const QByteArray& key,
+                 RpcCaller* caller,
+                 int tries = 5);
+
+    // Passes a reply to its caller. Returns false if it doesn't answer a
+    // call in flight, e.g. because the request had no ID.
+    bool reply(PrivateMessage* reply);
+
+    // Stops reporting to caller, e.g. because it's being deleted
+    void cancel(RpcCaller* caller);
+
+    // Number of calls in flight
+    int count() { return m_calls.count(); }
+
+private:
+    struct Call
+    {
+        Call(Rpc* rpc) : m_rpc(rpc), m_timer(this, &Call::timedOut) { }
+
+        void timedOut() { m_rpc->timedOut(this); }
+
+        Rpc* m_rpc;
+        quint32 m_id;
+        QByteArray m_key;
+        PrivateMessage* m_request;
+        QList<RpcCaller*> m_callers;
+        int m_triesLeft;
+
+        // Current timeout in ms, and the timer for the current try
+        int m_timeout;
+        MemberTimer<Call> m_timer;
+    };
+
+    // Resends a call whose try timed out, or fails it if it's out of tries
+    void timedOut(Call* call);
+
+    // Removes a call, then reports its outcome to its callers
+    void finish(Call* call, PrivateMessage* reply);
+
+    QHash<quint32, Call*> m_calls;
+
+    // Calls keyed by destination and key
+    QHash<QByteArray, Call*> m_byKey;
+
+    quint32 m_nextId;
+
+    // Callers being reported to by finish, so that cancel can remove them
+    QList<RpcCaller*>* m_reporting;
+};
+
+extern Rpc* GlobalRpc;
+
+#endif // RPC_HH
@@ -1,47 +1,71 @@
 #include <QDebug>
+#include <QDateTime>
 
 #include "Search.hh"
+#include "SearchManager.hh"
 #include "NetSocket.hh"
+#include "Dht.hh"
 
 #define MAX_RESULTS (10)
 #define INIT_BUDGET (2)
 #define MAX_BUDGET (100)
 
-Search::Search(QString& terms)
+// ms between checks of the budget controller
+#define SEARCH_TICK (250)
+
+// Initial estimate of the ms between a flood and its first reply
+#define INIT_LATENCY (1000)
+
+// Bounds on the ms a ring is given to answer, which is twice the latency
+#define MIN_WAIT (500)
+#define MAX_WAIT (5000)
+
+Search::Search(const QString& terms, quint32 queryId)
+    : m_timer(this, &Search::execute)
 {
     m_terms = terms;
+    m_queryId = queryId;
     m_budget = INIT_BUDGET;
-    m_timer = new QTimer(this);
-    connect(m_timer, SIGNAL(timeout()), this, SLOT(execute()));
-    m_timer->setInterval(1000);
+    m_granted = 0;
+    m_maxSent = 0;
+    m_lastFlood = 0;
+    m_lastResult = 0;
+    m_resultsSinceFlood = 0;
+    m_latency = INIT_LATENCY;
 }
 
 void Search::beginSearch()
 {
-    m_timer->start();
+    // Keywords stored in the DHT take a few lookups to find, so ask for them
+    // alongside the flood
+    GlobalDht->findKeywords(m_terms, m_queryId);
+    m_timer.startRepeating(SEARCH_TICK);
+    execute();
 }
 
-void Search::addResult(QString& terms, QString &fileName, QByteArray &hash, QString &host)
+void Search::addResult(QString &fileName, QByteArray &hash, QString &host)
 {
-    // Make sure this is a result for the search we're currently doing
-    if (terms != m_terms)
-    {
-        qDebug() << "Got search result for wrong search terms";
-        return;
-    }
-
     // If this is a new file, add it to result table and emit newSearchResult
     if (!m_results.contains(hash))
     {
         qDebug() << "GOT NEW SEARCH RESULT: " << fileName;
         m_results.insert(hash, host);
         QString hashHex(hash.toHex());
-        emit newSearchResult(fileName, host, hashHex);
+        emit newSearchResult(m_queryId, m_terms, fileName, host, hashHex);
+
+        // The first result of a ring gives a latency sample
+        qint64 now = QDateTime::currentMSecsSinceEpoch();
+        if (m_resultsSinceFlood == 0 && m_lastFlood > 0)
+        {
+            m_latency = (3 * m_latency + (now - m_lastFlood)) / 4;
+        }
+        m_resultsSinceFlood++;
+        m_lastResult = now;
 
         // Stop broadcasting if we've gotten to MAX_RESULTS
         if (m_results.count() >= MAX_RESULTS)
         {
-            m_timer->stop();
+            stop();
             qDebug() << "Reached max results for search: " << m_terms;
         }
     }
@@ -51,12 +75,64 @@ void Search::addResult(QString& terms, QString &fileName, QByteArray &hash, QStr
     }
 }
 
+bool Search::wantsMore()
+{
+    return m_results.count() < MAX_RESULTS;
+}
+
+void Search::stop()
+{
+    m_timer.stop();
+    GlobalSearches->releaseBudget(this);
+}
+
 void Search::execute()
 {
-    // Don't broadcast if our results are full or the budget is too big
-    if (m_results.count() >= MAX_RESULTS || m_budget > MAX_BUDGET) return;
+    if (!wantsMore())
+    {
+        stop();
+        return;
+    }
+
+    if (m_lastFlood == 0)
+    {
+        flood(m_budget);
+        return;
+    }
+
+    // Give the last ring time to answer. While results keep arriving, wait
+    // for them to dry up before flooding further.
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64 wait = qBound((qint64)MIN_WAIT, 2 * m_latency, (qint64)MAX_WAIT);
+    if (now - m_lastFlood < wait || now - m_lastResult < wait) return;
+
+    if (m_budget >= MAX_BUDGET)
+    {
+        // The widest ring has been given its time; more floods would only
+        // find duplicates
+        qDebug() << "Search exhausted at max budget: " << m_terms
+            << ", results: " << m_results.count();
+        stop();
+        return;
+    }
+
+    // Expand the ring. A ring that found nothing suggests the results are
+    // far away, so skip ahead faster.
+    int factor = m_resultsSinceFlood > 0 ? 2 : 4;
+    flood(qMin(MAX_BUDGET, m_budget * factor));
+}
+
+void Search::flood(int budget)
+{
+    // Other searches may hold the rest of the budget cap; wait for them
+    int granted = GlobalSearches->grantBudget(this, budget);
+    if (granted == 0) return;
+
+    qDebug() << "SENDING NEW SEARCH REQUEST: " << m_terms << ", budget: " << granted;
+    GlobalSocket->sendSearchRequest(m_terms, granted, m_queryId);
 
-    qDebug() << "SENDING NEW SEARCH REQUEST: " << m_terms << ", budget: " << m_budget;
-    GlobalSocket->sendSearchRequest(m_terms, m_budget);
-    m_budget *= 2;
+    m_budget = granted;
+    m_maxSent = qMax(m_maxSent, granted);
+    m_lastFlood = QDateTime::currentMSecsSinceEpoch();
+    m_resultsSinceFlood = 0;
 }
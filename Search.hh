@@ -5,41 +5,81 @@
 #include <QHash>
 #include <QString>
 #include <QByteArray>
-#include <QTimer>
 
+#include "TimerWheel.hh"
+
+// A single search for files, run by GlobalSearches
 class Search : public QObject
 {
     Q_OBJECT
 
 public:
-    Search(QString& terms);
+    Search(const QString& terms, quint32 queryId);
 
     // Begins search by starting the broadcast timer
     void beginSearch();
 
+    // Adds a search result that we received from a peer
+    void addResult(QString& fileName, QByteArray& hash, QString& host);
+
+    // True until the search has all the results it needs
+    bool wantsMore();
+
+    // True while the search is still flooding requests
+    bool isActive() { return m_timer.isActive(); }
+
+    // Stops flooding and releases our budget
+    void stop();
+
     // The search string. Space-separated list of search terms.
     QString m_terms;
 
+    // Identifies this search in every rebroadcast so that nodes can tell
+    // repeats apart from new searches, and in every reply. Never 0.
+    quint32 m_queryId;
+
     // Keyed by fileIDs. Contains origin value of the owner of the file.
     QHash<QByteArray, QString> m_results;
 
-public slots:
-    // Executes the search by sending out messages to peers. Makes call to
-    // GlobalSocket.
-    void execute();
+    // Budget GlobalSearches granted to the latest broadcast
+    int m_granted;
 
-    // Adds a search result that we received from a peer
-    void addResult(QString& terms, QString& fileName, QByteArray& hash, QString& host);
+    // Largest budget flooded so far; a cancel is flooded as far
+    int m_maxSent;
 
 signals:
-    void newSearchResult(QString& fileName, QString& origin, QString& hash);
+    void newSearchResult(quint32 queryId,
+                         QString& terms,
+                         QString& fileName,
+                         QString& origin,
+                         QString& hash);
 
 private:
-    // Rebroadcast budget for the next broadcast (thus it is increased after
-    // a broadcast)
+    // Budget controller, run every tick. Floods an expanding ring of
+    // requests: each ring is given time to answer, based on the observed
+    // reply latency, and the next, wider ring is only flooded once replies
+    // stop arriving. The search stops once it has enough results or the
+    // widest ring has gone quiet.
+    void execute();
+
+    // Floods a request with the given budget, or as much of it as
+    // GlobalSearches grants
+    void flood(int budget);
+
+    // Budget of the latest ring
     int m_budget;
 
-    QTimer* m_timer;
+    // Times of the latest flood and result, in ms since the epoch
+    qint64 m_lastFlood;
+    qint64 m_lastResult;
+
+    int m_resultsSinceFlood;
+
+    // Moving average of the ms between a flood and its first result
+    qint64 m_latency;
+
+    // Rebroadcast timer
+    MemberTimer<Search> m_timer;
 };
 
 #endif // SEARCH_HH
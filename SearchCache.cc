@@ -0,0 +1,82 @@
+#include <QDateTime>
+#include <QStringList>
+
+#include "SearchCache.hh"
+
+// Maximum number of queries whose results are cached
+#define MAX_CACHED_QUERIES (512)
+
+// Maximum number of results cached per query
+#define MAX_CACHED_RESULTS (32)
+
+// ms that cached results stay valid
+#define RESULT_TTL (300000)
+
+QString SearchCache::normalize(const QString& searchTerms)
+{
+    QStringList terms = searchTerms.toLower().split(" ", QString::SkipEmptyParts);
+    terms.removeDuplicates();
+    terms.sort();
+    return terms.join(" ");
+}
+
+void SearchCache::add(const QString& searchTerms,
+                      const QString& fileName,
+                      const QByteArray& fileId,
+                      const QString& provider)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    expire(now);
+
+    QString key = normalize(searchTerms);
+    if (key.isEmpty()) return;
+
+    if (!m_queries.contains(key))
+    {
+        if (m_order.count() >= MAX_CACHED_QUERIES)
+        {
+            m_queries.remove(m_order.dequeue());
+        }
+        m_order.enqueue(key);
+    }
+
+    Query& query = m_queries[key];
+    query.m_expires = now + RESULT_TTL;
+
+    for (int i = 0; i < query.m_results.count(); i++)
+    {
+        if (query.m_results[i].m_fileId == fileId
+            && query.m_results[i].m_provider == provider)
+        {
+            return;
+        }
+    }
+    if (query.m_results.count() >= MAX_CACHED_RESULTS) return;
+
+    Result result;
+    result.m_fileName = fileName;
+    result.m_fileId = fileId;
+    result.m_provider = provider;
+    query.m_results.append(result);
+}
+
+QList<SearchCache::Result> SearchCache::find(const QString& searchTerms)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    expire(now);
+
+    Query query = m_queries.value(normalize(searchTerms));
+    if (query.m_expires < now) return QList<Result>();
+    return query.m_results;
+}
+
+void SearchCache::expire(qint64 now)
+{
+    // Entries are refreshed when new results arrive, so the queue isn't
+    // strictly in expiry order; stop at the first unexpired query
+    while (!m_order.isEmpty()
+           && m_queries.value(m_order.head()).m_expires < now)
+    {
+        m_queries.remove(m_order.dequeue());
+    }
+}
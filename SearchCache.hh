@@ -0,0 +1,61 @@
+#ifndef SEARCH_CACHE_HH
+#define SEARCH_CACHE_HH
+
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QQueue>
+#include <QList>
+
+// Cache of search results received from other nodes, keyed by normalized
+// search terms. Lets this node answer popular queries on behalf of the nodes
+// that actually share the files. Entries expire after a while and the oldest
+// queries are dropped once the cache is full.
+class SearchCache
+{
+public:
+    SearchCache() { }
+
+    struct Result
+    {
+        QString m_fileName;
+        QByteArray m_fileId;
+
+        // ORIGIN of the node that shares the file
+        QString m_provider;
+    };
+
+    // Records a result for the given search terms
+    void add(const QString& searchTerms,
+             const QString& fileName,
+             const QByteArray& fileId,
+             const QString& provider);
+
+    // Returns the unexpired results cached for the given search terms
+    QList<Result> find(const QString& searchTerms);
+
+    // Returns the terms lowercased, deduplicated, sorted, and joined by single
+    // spaces, so that equivalent searches share a key
+    static QString normalize(const QString& searchTerms);
+
+private:
+    struct Query
+    {
+        Query() : m_expires(0) { }
+
+        QList<Result> m_results;
+
+        // Time the results expire, in ms since the epoch
+        qint64 m_expires;
+    };
+
+    void expire(qint64 now);
+
+    // Keyed by normalized search terms
+    QHash<QString, Query> m_queries;
+
+    // Normalized search terms in the order they were cached
+    QQueue<QString> m_order;
+};
+
+#endif // SEARCH_CACHE_HH
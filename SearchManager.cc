@@ -0,0 +1,111 @@
+#include <QDebug>
+
+#include "SearchManager.hh"
+#include "Search.hh"
+#include "NetSocket.hh"
+
+// Most searches that can run at once
+#define MAX_SEARCHES (64)
+
+// Most budget that all searches together can have outstanding
+#define MAX_TOTAL_BUDGET (400)
+
+SearchManager* GlobalSearches;
+
+SearchManager::SearchManager()
+{
+    m_outstanding = 0;
+}
+
+quint32 SearchManager::start(const QString& terms)
+{
+    if (m_searches.count() >= MAX_SEARCHES)
+    {
+        qDebug() << "Too many searches running; not starting " << terms;
+        return 0;
+    }
+
+    quint32 queryId;
+    do
+    {
+        queryId = ((quint32)rand() << 16) ^ (quint32)rand();
+    } while (queryId == 0 || m_searches.contains(queryId));
+
+    Search* search = new Search(terms, queryId);
+    m_searches.insert(queryId, search);
+    m_byTerms.insert(search->m_terms, queryId);
+
+    connect(search, SIGNAL(newSearchResult(quint32,QString&,QString&,QString&,QString&)),
+            this, SIGNAL(newSearchResult(quint32,QString&,QString&,QString&,QString&)));
+
+    search->beginSearch();
+    return queryId;
+}
+
+void SearchManager::cancel(quint32 queryId)
+{
+    Search* search = m_searches.take(queryId);
+    if (!search) return;
+
+    if (m_byTerms.value(search->m_terms) == queryId)
+    {
+        m_byTerms.remove(search->m_terms);
+    }
+    // Tell the nodes the search reached to drop any of its requests still
+    // being flooded
+    if (search->isActive() && search->m_maxSent > 0)
+    {
+        qDebug() << "Flooding cancel for search: " << search->m_terms;
+        GlobalSocket->sendSearchRequest(search->m_terms,
+                                        search->m_maxSent,
+                                        queryId,
+                                        QString(),
+                                        QByteArray(),
+                                        true);
+    }
+
+    search->stop();
+    delete search;
+}
+
+int SearchManager::grantBudget(Search* search, int wanted)
+{
+    releaseBudget(search);
+
+    int granted = qBound(0, wanted, MAX_TOTAL_BUDGET - m_outstanding);
+    search->m_granted = granted;
+    m_outstanding += granted;
+    return granted;
+}
+
+void SearchManager::releaseBudget(Search* search)
+{
+    m_outstanding -= search->m_granted;
+    search->m_granted = 0;
+}
+
+bool SearchManager::wantsMore(quint32 queryId, const QString& terms)
+{
+    if (queryId == 0) queryId = m_byTerms.value(terms, 0);
+
+    Search* search = m_searches.value(queryId, NULL);
+    return search && search->wantsMore();
+}
+
+void SearchManager::addResult(quint32 queryId,
+                              QString& terms,
+                              QString& fileName,
+                              QByteArray& hash,
+                              QString& host)
+{
+    if (queryId == 0) queryId = m_byTerms.value(terms, 0);
+
+    Search* search = m_searches.value(queryId, NULL);
+    if (!search || search->m_terms != terms)
+    {
+        qDebug() << "Got search result for no running search: " << terms;
+        return;
+    }
+
+    search->addResult(fileName, hash, host);
+}
@@ -0,0 +1,79 @@
+#ifndef SEARCH_MANAGER_HH
+#define SEARCH_MANAGER_HH
+
+#include <QObject>
+#include <QHash>
+#include <QString>
+#include <QByteArray>
+
+class Search;
+
+// Owns the searches this node is running. Searches are keyed by query ID,
+// the nonce carried by their requests and echoed by replies, so a reply is
+// matched to its search with a single lookup. The manager also caps the
+// budget that all searches together have outstanding.
+class SearchManager : public QObject
+{
+    Q_OBJECT
+
+public:
+    SearchManager();
+
+    // Starts a search. Returns its query ID, or 0 if too many searches are
+    // running. A search keeps collecting late results after it stops
+    // flooding, so it counts as running until it's canceled.
+    quint32 start(const QString& terms);
+
+    // Stops and deletes a search. Unknown query IDs are ignored.
+    void cancel(quint32 queryId);
+
+    // Returns the search with the given query ID, or NULL
+    Search* find(quint32 queryId) { return m_searches.value(queryId, NULL); }
+
+    int count() { return m_searches.count(); }
+
+    // True if the search that a reply answers still wants more results, so
+    // the next page of the reply is worth fetching
+    bool wantsMore(quint32 queryId, const QString& terms);
+
+    // Called by a search before it floods a request. Returns the budget it
+    // may use, which may be less than it wants or 0 if the other searches
+    // have the whole cap outstanding. The search's previous grant is
+    // released first.
+    int grantBudget(Search* search, int wanted);
+
+    // Releases the budget granted to a search that has stopped flooding
+    void releaseBudget(Search* search);
+
+public slots:
+    // Passes a result to the search with the given query ID. Replies from
+    // nodes that don't echo the query ID have a queryId of 0, and are matched
+    // by their search terms instead.
+    void addResult(quint32 queryId,
+                   QString& terms,
+                   QString& fileName,
+                   QByteArray& hash,
+                   QString& host);
+
+signals:
+    void newSearchResult(quint32 queryId,
+                         QString& terms,
+                         QString& fileName,
+                         QString& origin,
+                         QString& hash);
+
+private:
+    // Searches keyed by query ID
+    QHash<quint32, Search*> m_searches;
+
+    // Query ID of the latest search for each search string, for replies
+    // without a query ID
+    QHash<QString, quint32> m_byTerms;
+
+    // Sum of the budgets granted to the searches
+    int m_outstanding;
+};
+
+extern SearchManager* GlobalSearches;
+
+#endif // SEARCH_MANAGER_HH
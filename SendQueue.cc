@@ -0,0 +1,197 @@
+#include <errno.h>
+
+#include <QDebug>
+#include <QDateTime>
+
+#include "SendQueue.hh"
+
+// Bytes a destination may send per round of deficit round robin; one block
+// reply fits
+#define QUANTUM (9000)
+
+// Default pacing rate per destination in bytes per second
+#define PACE_RATE (2000000)
+
+// A bucket holds the tokens for this many timer ticks, so that the tokens
+// added between two ticks aren't lost to the cap even when a tick runs late.
+// It always holds at least one datagram of the largest size.
+#define BURST_TICKS (2)
+#define MIN_BURST (65536)
+
+// Most bytes queued per class before new datagrams are dropped
+#define MAX_QUEUED_BYTES (4 * 1024 * 1024)
+
+// ms to wait before retrying when blocked
+#define RETRY_DELAY (10)
+
+// Buckets are forgotten once they've been full this long, in ms
+#define BUCKET_IDLE (60000)
+
+SendQueue::SendQueue(QUdpSocket* socket)
+    : m_retryTimer(this, &SendQueue::drain)
+{
+    m_socket = socket;
+    setPaceRate(PACE_RATE);
+    for (int cls = 0; cls < NUM_CLASSES; cls++) m_queuedBytes[cls] = 0;
+}
+
+SendQueue::~SendQueue()
+{
+    for (int cls = 0; cls < NUM_CLASSES; cls++) qDeleteAll(m_active[cls]);
+}
+
+void SendQueue::setPaceRate(int bytesPerSec)
+{
+    if (bytesPerSec <= 0) return;
+
+    m_paceRate = bytesPerSec / 1000.0;
+    m_paceBurst = qMax(m_paceRate * TimerWheel::TICK_MS * BURST_TICKS, (double)MIN_BURST);
+}
+
+void SendQueue::send(const QByteArray& datagram,
+                     const QHostAddress& address,
+                     quint16 port,
+                     Class cls)
+{
+    if (m_queuedBytes[cls] + datagram.size() > MAX_QUEUED_BYTES)
+    {
+        qDebug() << "Send queue full, dropping datagram for "
+            << address.toString() << ":" << port;
+        return;
+    }
+
+    NeighborKey key(address, port);
+    Flow* flow = m_flows[cls].value(key, NULL);
+    if (!flow)
+    {
+        flow = new Flow(key);
+        m_flows[cls].insert(key, flow);
+        m_active[cls].append(flow);
+    }
+
+    Datagram queued;
+    queued.m_data = datagram;
+    queued.m_address = address;
+    queued.m_port = port;
+    flow->m_datagrams.enqueue(queued);
+    m_queuedBytes[cls] += datagram.size();
+
+    drain();
+}
+
+void SendQueue::drain()
+{
+    for (int cls = 0; cls < NUM_CLASSES; cls++)
+    {
+        if (!drainClass(cls)) break;
+    }
+
+    bool queued = false;
+    for (int cls = 0; cls < NUM_CLASSES; cls++)
+    {
+        if (!m_active[cls].isEmpty()) queued = true;
+    }
+    if (queued) m_retryTimer.start(RETRY_DELAY);
+}
+
+bool SendQueue::drainClass(int cls)
+{
+    QList<Flow*>& active = m_active[cls];
+    bool paced = cls == Bulk;
+
+    // Flows in a row that were skipped for lack of tokens
+    int waiting = 0;
+    while (!active.isEmpty() && waiting < active.count())
+    {
+        Flow* flow = active.first();
+        if (paced && bucket(flow->m_key).m_tokens <= 0)
+        {
+            active.append(active.takeFirst());
+            waiting++;
+            continue;
+        }
+        waiting = 0;
+
+        flow->m_deficit += QUANTUM;
+        while (!flow->m_datagrams.isEmpty()
+               && flow->m_datagrams.head().m_data.size() <= flow->m_deficit)
+        {
+            Bucket& tokens = bucket(flow->m_key);
+            if (paced && tokens.m_tokens <= 0) break;
+
+            const Datagram& head = flow->m_datagrams.head();
+            int size = head.m_data.size();
+            if (m_socket->writeDatagram(head.m_data, head.m_address, head.m_port) < 0)
+            {
+                if (temporaryError())
+                {
+                    // The socket buffer is full; the datagram stays queued
+                    return false;
+                }
+
+                // Retrying won't help with other errors, e.g. an unreachable
+                // address or an oversized datagram, so drop it
+                qDebug() << "Dropping datagram for " << head.m_address.toString()
+                    << ":" << head.m_port << ": " << m_socket->errorString();
+            }
+            else
+            {
+                flow->m_deficit -= size;
+                tokens.m_tokens = qMax(tokens.m_tokens - size, -m_paceBurst);
+            }
+            m_queuedBytes[cls] -= size;
+            flow->m_datagrams.dequeue();
+        }
+
+        if (flow->m_datagrams.isEmpty())
+        {
+            active.removeFirst();
+            m_flows[cls].remove(flow->m_key);
+            delete flow;
+        }
+        else
+        {
+            active.append(active.takeFirst());
+        }
+    }
+    return true;
+}
+
+bool SendQueue::temporaryError()
+{
+#if QT_VERSION >= 0x050000
+    return m_socket->error() == QAbstractSocket::TemporaryError;
+#else
+    // Qt 4 reports every send error as a NetworkError, so look at errno
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS;
+#endif
+}
+
+SendQueue::Bucket& SendQueue::bucket(const NeighborKey& key)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    QHash<NeighborKey, Bucket>::iterator it = m_buckets.find(key);
+    if (it == m_buckets.end())
+    {
+        // Drop the buckets of destinations that have gone idle before
+        // adding one
+        QHash<NeighborKey, Bucket>::iterator old = m_buckets.begin();
+        while (old != m_buckets.end())
+        {
+            if (now - old.value().m_refilled > BUCKET_IDLE) old = m_buckets.erase(old);
+            else ++old;
+        }
+
+        Bucket fresh;
+        fresh.m_tokens = m_paceBurst;
+        fresh.m_refilled = now;
+        it = m_buckets.insert(key, fresh);
+    }
+
+    Bucket& tokens = it.value();
+    tokens.m_tokens = qMin(tokens.m_tokens + (now - tokens.m_refilled) * m_paceRate,
+                           m_paceBurst);
+    tokens.m_refilled = now;
+    return tokens;
+}
@@ -0,0 +1,107 @@
+#ifndef SEND_QUEUE_HH
+#define SEND_QUEUE_HH
+
+#include <QUdpSocket>
+#include <QByteArray>
+#include <QHostAddress>
+#include <QHash>
+#include <QList>
+#include <QQueue>
+
+#include "NeighborTable.hh"
+#include "TimerWheel.hh"
+
+// Schedules outgoing datagrams so that bursts of bulk data don't overflow the
+// socket buffer or hold up control traffic. Datagrams are queued by class
+// and destination. Control traffic goes first, then interactive, then bulk.
+// Within a class, destinations take turns by deficit round robin. Each
+// destination has a token bucket that paces its bulk traffic. Every datagram
+// sent to it draws from the bucket, but only bulk datagrams wait for tokens.
+class SendQueue
+{
+public:
+    enum Class
+    {
+        // Status, liveness probes and route rumors
+        Control,
+        // Chat, searches and other small requests
+        Interactive,
+        // Block replies and other large payloads
+        Bulk,
+        NUM_CLASSES
+    };
+
+    SendQueue(QUdpSocket* socket);
+    ~SendQueue();
+
+    // Queues a datagram, sending it right away if nothing is ahead of it
+    void send(const QByteArray& datagram,
+              const QHostAddress& address,
+              quint16 port,
+              Class cls);
+
+    // Sets the rate each destination's bulk traffic is paced to, in bytes
+    // per second
+    void setPaceRate(int bytesPerSec);
+
+private:
+    struct Datagram
+    {
+        QByteArray m_data;
+        QHostAddress m_address;
+        quint16 m_port;
+    };
+
+    // Datagrams of one class queued for one destination
+    struct Flow
+    {
+        Flow(const NeighborKey& key) : m_key(key), m_deficit(0) { }
+
+        NeighborKey m_key;
+        QQueue<Datagram> m_datagrams;
+
+        // Bytes the flow may still send in its current round
+        int m_deficit;
+    };
+
+    struct Bucket
+    {
+        double m_tokens;
+
+        // Time the bucket was last refilled, in ms since the epoch
+        qint64 m_refilled;
+    };
+
+    // Sends as much as the classes, buckets and socket allow
+    void drain();
+
+    // Sends the queued datagrams of one class. Returns false if the socket
+    // is full.
+    bool drainClass(int cls);
+
+    // True if the last failed write may succeed later, i.e. the socket
+    // buffer was full
+    bool temporaryError();
+
+    // Refills and returns a destination's bucket
+    Bucket& bucket(const NeighborKey& key);
+
+    // Flows with datagrams queued, keyed by destination, and the same flows
+    // in round robin order
+    QHash<NeighborKey, Flow*> m_flows[NUM_CLASSES];
+    QList<Flow*> m_active[NUM_CLASSES];
+    qint64 m_queuedBytes[NUM_CLASSES];
+
+    QHash<NeighborKey, Bucket> m_buckets;
+
+    // Pacing rate in bytes per ms, and the most a bucket holds
+    double m_paceRate;
+    double m_paceBurst;
+
+    QUdpSocket* m_socket;
+
+    // Retries sending once tokens or socket space are available again
+    MemberTimer<SendQueue> m_retryTimer;
+};
+
+#endif // SEND_QUEUE_HH
@@ -0,0 +1,94 @@
+#include "TimerWheel.hh"
+
+TimerWheel* GlobalTimers;
+
+void WheelLink::unlink()
+{
+    m_prev->m_next = m_next;
+    m_next->m_prev = m_prev;
+    m_prev = m_next = this;
+}
+
+void WheelLink::linkAfter(WheelLink* head)
+{
+    m_prev = head;
+    m_next = head->m_next;
+    head->m_next->m_prev = this;
+    head->m_next = this;
+}
+
+void WheelTimer::start(int ms)
+{
+    m_interval = 0;
+    GlobalTimers->arm(this, ms);
+}
+
+void WheelTimer::startRepeating(int ms)
+{
+    m_interval = qMax(1, ms);
+    GlobalTimers->arm(this, ms);
+}
+
+TimerWheel::TimerWheel()
+{
+    m_ticks = 0;
+    m_clock.start();
+
+    m_pTimer = new QTimer(this);
+    connect(m_pTimer, SIGNAL(timeout()), this, SLOT(tick()));
+    m_pTimer->start(TICK_MS);
+}
+
+void TimerWheel::arm(WheelTimer* timer, int ms)
+{
+    timer->unlink();
+
+    // round up so a timer never fires early; always wait at least one tick
+    qint64 ticks = qMax((qint64)1, ((qint64)ms + TICK_MS - 1) / TICK_MS);
+    qint64 due = m_ticks + ticks;
+
+    timer->m_rounds = (ticks - 1) / NUM_SLOTS;
+    timer->linkAfter(&m_slots[due % NUM_SLOTS]);
+}
+
+void TimerWheel::tick()
+{
+    // QTimer can fall behind when the event loop is busy, so catch up on
+    // every tick that should have happened by now
+    qint64 target = m_clock.elapsed() / TICK_MS;
+    while (m_ticks < target) advance();
+}
+
+void TimerWheel::advance()
+{
+    m_ticks++;
+    WheelLink* slot = &m_slots[m_ticks % NUM_SLOTS];
+
+    // Move due timers to m_firing first, since firing one may arm or cancel
+    // others in this slot
+    WheelLink* link = slot->m_next;
+    while (link != slot)
+    {
+        WheelLink* next = link->m_next;
+        WheelTimer* timer = static_cast<WheelTimer*>(link);
+        if (timer->m_rounds > 0)
+        {
+            timer->m_rounds--;
+        }
+        else
+        {
+            link->unlink();
+            link->linkAfter(m_firing.m_prev);
+        }
+        link = next;
+    }
+
+    // A timer removed from m_firing by a cancel is simply not fired
+    while (m_firing.isLinked())
+    {
+        WheelTimer* timer = static_cast<WheelTimer*>(m_firing.m_next);
+        timer->unlink();
+        if (timer->m_interval > 0) arm(timer, timer->m_interval);
+        timer->fired();
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef TIMER_WHEEL_HH
+#define TIMER_WHEEL_HH
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+
+// Link in one of the TimerWheel's intrusive lists
+class WheelLink
+{
+public:
+    WheelLink() : m_prev(this), m_next(this) { }
+
+    bool isLinked() const { return m_next != this; }
+    void unlink();
+
+    // Inserts this link after head
+    void linkAfter(WheelLink* head);
+
+    WheelLink* m_prev;
+    WheelLink* m_next;
+};
+
+// A timeout that can be scheduled on GlobalTimers. Subclasses implement
+// fired(). Destroying a WheelTimer cancels it.
+class WheelTimer : private WheelLink
+{
+public:
+    WheelTimer() : m_rounds(0), m_interval(0) { }
+    virtual ~WheelTimer() { unlink(); }
+
+    // Schedules fired() to be called after ms milliseconds, replacing any
+    // earlier schedule
+    void start(int ms);
+
+    // Like start(ms), and then keeps calling fired() every ms milliseconds
+    // until stopped
+    void startRepeating(int ms);
+
+    void stop() { m_interval = 0; unlink(); }
+
+    bool isActive() const { return isLinked(); }
+
+protected:
+    virtual void fired() = 0;
+
+private:
+    friend class TimerWheel;
+
+    // Remaining full turns of the wheel before this timer is due
+    int m_rounds;
+
+    // Interval of a repeating timer in ms; 0 if it isn't repeating
+    int m_interval;
+
+    Q_DISABLE_COPY(WheelTimer)
+};
+
+// WheelTimer that calls a member function of an object when it fires
+template <class T>
+class MemberTimer : public WheelTimer
+{
+public:
+    MemberTimer(T* obj, void (T::*func)()) : m_obj(obj), m_func(func) { }
+
+protected:
+    void fired() { (m_obj->*m_func)(); }
+
+private:
+    T* m_obj;
+    void (T::*m_func)();
+};
+
+// Hashed timing wheel that owns all of peerster's protocol timeouts. A single
+// QTimer drives the wheel; arming and canceling a timer is O(1) and costs no
+// QObject or event loop registration.
+class TimerWheel : public QObject
+{
+    Q_OBJECT
+
+public:
+    TimerWheel();
+
+    enum
+    {
+        // Resolution of the wheel in ms
+        TICK_MS = 50,
+        // Number of slots; one turn of the wheel is TICK_MS * NUM_SLOTS ms
+        NUM_SLOTS = 512
+    };
+
+    // Schedules timer to fire after ms milliseconds
+    void arm(WheelTimer* timer, int ms);
+
+private slots:
+    void tick();
+
+private:
+
+    void advance();
+
+    WheelLink m_slots[NUM_SLOTS];
+
+    // Timers that are due in the tick being processed
+    WheelLink m_firing;
+
+    // Number of ticks processed so far; the current slot is
+    // m_ticks % NUM_SLOTS
+    qint64 m_ticks;
+
+    QTimer* m_pTimer;
+    QElapsedTimer m_clock;
+};
+
+extern TimerWheel* GlobalTimers;
+
+#endif // TIMER_WHEEL_HH
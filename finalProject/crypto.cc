@@ -54,7 +54,8 @@ QByteArray Crypto::encrypt(const QString& dest,
                            const QByteArray& data,
                            QByteArray* cryptKey)
 {
-    if (!m_pubTable.contains(dest))
+    QCA::PublicKey* pubKey = findPubKey(GlobalOrigins->find(dest));
+    if (!pubKey)
     {
         qDebug() << "No public key on record for user " << dest;
         return QByteArray();
@@ -66,7 +67,7 @@ QByteArray Crypto::encrypt(const QString& dest,
     QCA::SymmetricKey key(32);
 
     // Encypt the AES key with the user's public key and place it in cryptKey
-    *cryptKey = m_pubTable[dest].encrypt(key, QCA::EME_PKCS1_OAEP).toByteArray();
+    *cryptKey = pubKey->encrypt(key, QCA::EME_PKCS1_OAEP).toByteArray();
 
     // Encrypt the data with the AES key
     QCA::Cipher cipher(QString("aes256"), QCA::Cipher::CBC,
@@ -119,23 +120,51 @@ QByteArray Crypto::sign(const QByteArray& data)
     return result;
 }
 
-bool Crypto::checkSig(const QString& origin, const QByteArray& data, const QByteArray& sig)
+QCA::PublicKey* Crypto::findPubKey(int originId)
 {
-    if (!m_pubTable.contains(origin))
+    if (originId < 0
+        || originId >= m_pubTable.count()
+        || m_pubTable[originId].isNull())
     {
-        qDebug() << "No pubic key on record for user " << origin;
+        return NULL;
+    }
+    return &m_pubTable[originId];
+}
+
+bool Crypto::checkSig(int originId, const QByteArray& data, const QByteArray& sig)
+{
+    QCA::PublicKey* pubKey = findPubKey(originId);
+    if (!pubKey)
+    {
+        qDebug() << "No pubic key on record for user "
+            << (originId >= 0 ? GlobalOrigins->name(originId) : QString());
         return false;
     }
 
     QCA::SecureArray message(data);
-    return m_pubTable[origin].verifyMessage(message, sig, QCA::EMSA3_MD5);
+    return pubKey->verifyMessage(message, sig, QCA::EMSA3_MD5);
 }
 
-QByteArray Crypto::pubKeyVal(const QString& name)
+bool Crypto::checkSigWithKey(const QByteArray& pubKey,
+                             const QVariantMap& map,
+                             const QByteArray& sig)
 {
-    if (m_pubTable.contains(name))
+    if (pubKey.isEmpty() || sig.isEmpty()) return false;
+
+    QCA::SecureArray secPubKey(pubKey);
+    QCA::BigInteger n(secPubKey);
+    QCA::RSAPublicKey rsaPubKey(n, QCA::BigInteger(RSA_EXP));
+
+    QCA::SecureArray message(serialize(map));
+    return rsaPubKey.verifyMessage(message, sig, QCA::EMSA3_MD5);
+}
+
+QByteArray Crypto::pubKeyVal(int originId)
+{
+    QCA::PublicKey* pubKey = findPubKey(originId);
+    if (pubKey)
     {
-        return m_pubTable[name].toRSA().n().toArray().toByteArray();
+        return pubKey->toRSA().n().toArray().toByteArray();
     }
     else
     {
@@ -143,9 +172,18 @@ QByteArray Crypto::pubKeyVal(const QString& name)
     }
 }
 
-bool Crypto::isTrusted(const QString& name)
+bool Crypto::isTrusted(int originId)
+{
+    return originId >= 0
+        && originId < m_trusted.count()
+        && m_trusted[originId];
+}
+
+void Crypto::setTrusted(const QString& name)
 {
-    return m_trusted.contains(name);
+    int originId = GlobalOrigins->intern(name);
+    if (originId >= m_trusted.count()) m_trusted.resize(originId + 1);
+    m_trusted[originId] = true;
 }
 
 bool Crypto::addTrust(const QString& name,
@@ -157,7 +195,7 @@ bool Crypto::addTrust(const QString& name,
     {
         qDebug() << "Verified signature of " << signer;
         qDebug() << "Now trusting " << name;
-        m_trusted.insert(name);
+        setTrusted(name);
         GlobalChatDialog->addTrust(name);
         return true;
     }
@@ -169,13 +207,15 @@ bool Crypto::addTrust(const QString& name,
     }
 }
 
-void Crypto::addPubKey(const QString& name, const QByteArray& pubKey)
+void Crypto::addPubKey(int originId, const QByteArray& pubKey)
 {
-    if (m_pubTable.contains(name))
+    QCA::PublicKey* oldKey = findPubKey(originId);
+    if (oldKey)
     {
-        if (m_pubTable[name].toRSA().n().toArray().toByteArray() != pubKey)
+        if (oldKey->toRSA().n().toArray().toByteArray() != pubKey)
         {
-            qDebug() << "RECEIVED CONFLICTING PUB KEYS FOR USER " << name;
+            qDebug() << "RECEIVED CONFLICTING PUB KEYS FOR USER "
+                << GlobalOrigins->name(originId);
         }
     }
     else
@@ -186,9 +226,10 @@ void Crypto::addPubKey(const QString& name, const QByteArray& pubKey)
         QCA::RSAPublicKey rsaPubKey(n, QCA::BigInteger(RSA_EXP));
 
         // Insert it into table
-        m_pubTable.insert(name, rsaPubKey.toPublicKey());
+        if (originId >= m_pubTable.count()) m_pubTable.resize(originId + 1);
+        m_pubTable[originId] = rsaPubKey.toPublicKey();
 
-        qDebug() << "Received new pubkey for user " << name;
+        qDebug() << "Received new pubkey for user " << GlobalOrigins->name(originId);
     }
 }
 
@@ -228,14 +269,14 @@ void Crypto::startChallenge(const QString& dest, const QString& answer)
 
 bool Crypto::endChallenge(const QString& dest, const QByteArray& cryptKey)
 {
-    if (m_challenges.contains(dest) && m_pubTable.contains(dest))
+    QByteArray pubKey = pubKeyVal(dest);
+    if (m_challenges.contains(dest) && !pubKey.isEmpty())
     {
-        QByteArray pubKey = m_pubTable[dest].toRSA().n().toArray().toByteArray();
         bool passed = m_challenges[dest].check(pubKey, cryptKey);
         m_challenges.remove(dest);
         if (passed)
         {
-            m_trusted.insert(dest);
+            setTrusted(dest);
             GlobalChatDialog->addTrust(dest);
         }
         return passed;
@@ -250,11 +291,11 @@ bool Crypto::endChallenge(const QString& dest, const QByteArray& cryptKey)
     }
 }
 
-QList<QVariant> Crypto::keySigList(const QString& name)
+QList<QVariant> Crypto::keySigList(int originId)
 {
-    if (m_keySigLists.contains(name))
+    if (originId >= 0 && originId < m_keySigLists.count())
     {
-        return m_keySigLists[name];
+        return m_keySigLists[originId];
     }
     else
     {
@@ -262,10 +303,11 @@ QList<QVariant> Crypto::keySigList(const QString& name)
     }
 }
 
-void Crypto::updateKeySigList(const QString& name,
-                              const QList<QVariant> keySigList)
+void Crypto::updateKeySigList(int originId,
+                              const QList<QVariant>& keySigList)
 {
-    m_keySigLists.insert(name, keySigList);
+    if (originId >= m_keySigLists.count()) m_keySigLists.resize(originId + 1);
+    m_keySigLists[originId] = keySigList;
 }
 
 QByteArray Crypto::encryptKey(const QString& chalAnswer)
@@ -7,8 +7,10 @@
 #include <QString>
 #include <QSet>
 #include <QVariantMap>
+#include <QVector>
 
 #include "trustchallenge.hh"
+#include "../Origins.hh"
 
 #define RSA_BITS (1024)
 #define RSA_EXP (65537)
@@ -48,18 +50,32 @@ public:
     { return sign(serialize(map)); }
 
     // Checks the validity of another user's signature. Returns true if valid.
-    bool checkSig(const QString& origin, const QByteArray& data, const QByteArray& sig);
+    bool checkSig(int originId, const QByteArray& data, const QByteArray& sig);
+    bool checkSig(int originId, const QVariantMap& map, const QByteArray& sig)
+    { return checkSig(originId, serialize(map), sig); }
+    bool checkSig(const QString& origin, const QByteArray& data, const QByteArray& sig)
+    { return checkSig(GlobalOrigins->find(origin), data, sig); }
     bool checkSig(const QString& origin, const QVariantMap& map, const QByteArray& sig)
-    { return checkSig(origin, serialize(map), sig); }
+    { return checkSig(GlobalOrigins->find(origin), serialize(map), sig); }
+
+    // Checks a signature against a public key value that isn't in the table,
+    // e.g. one sent by an origin we haven't registered yet
+    bool checkSigWithKey(const QByteArray& pubKey,
+                         const QVariantMap& map,
+                         const QByteArray& sig);
 
     // Adds a user's public key to the table
-    void addPubKey(const QString& name, const QByteArray& pubKey);
+    void addPubKey(int originId, const QByteArray& pubKey);
+    void addPubKey(const QString& name, const QByteArray& pubKey)
+    { addPubKey(GlobalOrigins->intern(name), pubKey); }
 
     // Returns the RSA public key value as an array ready to be sent over the
     // network
     QByteArray pubKeyVal() { return m_pub.toRSA().n().toArray().toByteArray(); }
     // Returns an empty array if we don't have a public key for name
-    QByteArray pubKeyVal(const QString& name);
+    QByteArray pubKeyVal(int originId);
+    QByteArray pubKeyVal(const QString& name)
+    { return pubKeyVal(GlobalOrigins->find(name)); }
 
     // Sets flags to intentionally create invalid signatures and/or invalid
     // encryption for testing purposes
@@ -71,8 +87,12 @@ private:
     QCA::PrivateKey m_priv;
     QCA::PublicKey m_pub;
 
-    // Table of public keys from other users, keyed by origin name
-    QHash<QString, QCA::PublicKey> m_pubTable;
+    // Table of public keys from other users, indexed by origin ID. Null keys
+    // are origins we have no public key for.
+    QVector<QCA::PublicKey> m_pubTable;
+
+    // Returns the public key for the given origin, or NULL if we don't have one
+    QCA::PublicKey* findPubKey(int originId);
 
     QByteArray serialize(const QVariantMap& map);
     QVariantMap deserialize(const QByteArray& data);
@@ -106,10 +126,12 @@ public:
     QList<QVariant> keySigList();
 
     // Returns a list of signers of a given individual's public key
-    QList<QVariant> keySigList(const QString& name);
+    QList<QVariant> keySigList(int originId);
+    QList<QVariant> keySigList(const QString& name)
+    { return keySigList(GlobalOrigins->find(name)); }
 
     // Updates the list of signers of a given individual's public key
-    void updateKeySigList(const QString& name, const QList<QVariant> keySigList);
+    void updateKeySigList(int originId, const QList<QVariant>& keySigList);
 
     // Starts a trust challenge with the given user.
     void startChallenge(const QString& dest, const QString& answer);
@@ -118,15 +140,18 @@ public:
     bool endChallenge(const QString& dest, const QByteArray& cryptKey);
 
     // Checks if the given user is trusted; returns true if trusted
-    bool isTrusted(const QString& name);
+    bool isTrusted(int originId);
+    bool isTrusted(const QString& name)
+    { return isTrusted(GlobalOrigins->find(name)); }
 
     // Verifies that sig is signer's signature of name's public key, and that
     // I trust signer. If so, trust name and return true.
     bool addTrust(const QString& name, const QString& signer, const QByteArray& sig);
 
 private:
-    // Set of trusted origin names
-    QSet<QString> m_trusted;
+    // Indexed by origin ID. True if we trust that origin.
+    QVector<bool> m_trusted;
+    void setTrusted(const QString& name);
 
     // Contains the currently running trust challenges
     QHash<QString, TrustChallenge> m_challenges;
@@ -134,8 +159,8 @@ private:
     // Table of signatures from other users of my public key.
     QHash<QString, QByteArray> m_keySigs;
 
-    // Table of lists of key signers, keyed by host name
-    QHash<QString, QList<QVariant> > m_keySigLists;
+    // Table of lists of key signers, indexed by origin ID
+    QVector<QList<QVariant> > m_keySigLists;
 };
 
 extern Crypto* GlobalCrypto;
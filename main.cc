@@ -11,6 +11,13 @@
 #include "messageinfo.hh"
 #include "addrinfo.hh"
 #include "FileStore.hh"
+#include "Origins.hh"
+#include "Gossip.hh"
+#include "Dht.hh"
+#include "SearchManager.hh"
+#include "Rpc.hh"
+#include "DownloadScheduler.hh"
+#include "TimerWheel.hh"
 #include "finalProject/crypto.hh"
 
 int main(int argc, char **argv)
@@ -23,13 +30,21 @@ int main(int argc, char **argv)
     // Initialize Qt toolkit
     QApplication app(argc,argv);
 
-    // Create some global objects
+    // Create some global objects. GlobalOrigins comes first since the others
+    // intern origin names as they're created.
+    GlobalOrigins = new OriginRegistry();
+    GlobalTimers = new TimerWheel();
+    GlobalGossip = new GossipPolicy();
     GlobalSocket = new NetSocket();
+    GlobalRpc = new Rpc();
     GlobalChatDialog = new ChatDialog();
     GlobalMessages = new MessageStore();
     GlobalRoutes = new RouteTable();
     GlobalFiles = new FileStore();
+    GlobalDownloads = new DownloadScheduler();
     GlobalCrypto = new Crypto();
+    GlobalDht = new Dht();
+    GlobalSearches = new SearchManager();
 
     // Create an initial chat dialog window
     GlobalChatDialog->show();
@@ -52,6 +67,20 @@ int main(int argc, char **argv)
     QObject::connect(GlobalMessages, SIGNAL(newMessage(MessageInfo&, AddrInfo&, bool)),
                      GlobalRoutes, SLOT(addRoute(MessageInfo&, AddrInfo&, bool)));
 
+    // List finished downloads, which are shared automatically
+    QObject::connect(GlobalFiles, SIGNAL(sharingFile(const QString&)),
+                     GlobalChatDialog, SLOT(addSharedFile(const QString&)));
+
+    // Pass search results from the flood and from the DHT to the search they
+    // answer
+    QObject::connect(GlobalSocket, SIGNAL(gotSearchResult(quint32,QString&,QString&,QByteArray&,QString&)),
+                     GlobalSearches, SLOT(addResult(quint32,QString&,QString&,QByteArray&,QString&)));
+    QObject::connect(GlobalDht, SIGNAL(gotSearchResult(quint32,QString&,QString&,QByteArray&,QString&)),
+                     GlobalSearches, SLOT(addResult(quint32,QString&,QString&,QByteArray&,QString&)));
+
+    QObject::connect(GlobalSearches, SIGNAL(newSearchResult(quint32,QString&,QString&,QString&,QString&)),
+                     GlobalChatDialog, SLOT(printSearchResult(quint32,QString&,QString&,QString&,QString&)));
+
     // Parse command line arguments
     QStringList args = QCoreApplication::arguments();
     for (int i = 1; i < args.count(); i++)
@@ -68,12 +97,58 @@ int main(int argc, char **argv)
         {
             GlobalCrypto->setBadCrypto();
         }
+        else if (args[i] == "-fanout" && i + 1 < args.count())
+        {
+            GlobalGossip->setFanout(args[++i].toInt());
+        }
+        else if (args[i] == "-gossipmode" && i + 1 < args.count())
+        {
+            GlobalGossip->setMode(args[++i]);
+        }
+        else if (args[i] == "-stopprob" && i + 1 < args.count())
+        {
+            GlobalGossip->setStopProb(args[++i].toDouble());
+        }
+        else if (args[i] == "-maxpushes" && i + 1 < args.count())
+        {
+            GlobalGossip->setMaxPushes(args[++i].toInt());
+        }
+        else if (args[i] == "-retainage" && i + 1 < args.count())
+        {
+            GlobalMessages->setMaxAge(args[++i].toInt());
+        }
+        else if (args[i] == "-retaincount" && i + 1 < args.count())
+        {
+            GlobalMessages->setMaxCount(args[++i].toInt());
+        }
+        else if (args[i] == "-retainbytes" && i + 1 < args.count())
+        {
+            GlobalMessages->setMaxBytes(args[++i].toLongLong());
+        }
+        else if (args[i] == "-coldstore" && i + 1 < args.count())
+        {
+            GlobalMessages->setColdStore(args[++i]);
+        }
+        else if (args[i] == "-pacerate" && i + 1 < args.count())
+        {
+            GlobalSocket->setPaceRate(args[++i].toInt() * 1024);
+        }
+        else if (args[i] == "-downloadrate" && i + 1 < args.count())
+        {
+            GlobalDownloads->setRate(args[++i].toInt() * 1024);
+        }
+        else if (args[i] == "-maxrequests" && i + 1 < args.count())
+        {
+            GlobalDownloads->setMaxRequests(args[++i].toInt());
+        }
         else
         {
             GlobalSocket->addNeighbor(args[i]);
         }
     }
 
+    GlobalSocket->applyGossipPolicy();
+
     // send route rumor message to "prime the pump"
     GlobalSocket->sendRandRouteRumor();
 
@@ -6,6 +6,10 @@ MessageInfo::MessageInfo()
     m_hasLastRoute = false;
     m_hasSig = false;
     m_goodSig = false;
+    m_recvTime = 0;
+    m_hops = 0;
+    m_seqNo = 0;
+    m_originId = -1;
 }
 
 MessageInfo::MessageInfo(const QString& body, const QString& host, int seqNo)
@@ -14,8 +18,10 @@ MessageInfo::MessageInfo(const QString& body, const QString& host, int seqNo)
     m_hasLastRoute = false;
     m_hasSig = false;
     m_goodSig = false;
+    m_recvTime = 0;
+    m_hops = 0;
     m_body = body;
-    m_host = host;
+    m_originId = GlobalOrigins->intern(host);
     m_seqNo = seqNo;
 }
 
@@ -25,7 +31,21 @@ MessageInfo::MessageInfo(const QString& host, int seqNo)
     m_hasLastRoute = false;
     m_hasSig = false;
     m_goodSig = false;
-    m_host = host;
+    m_recvTime = 0;
+    m_hops = 0;
+    m_originId = GlobalOrigins->intern(host);
+    m_seqNo = seqNo;
+}
+
+MessageInfo::MessageInfo(int originId, int seqNo)
+{
+    m_isRoute = true;
+    m_hasLastRoute = false;
+    m_hasSig = false;
+    m_goodSig = false;
+    m_recvTime = 0;
+    m_hops = 0;
+    m_originId = originId;
     m_seqNo = seqNo;
 }
 
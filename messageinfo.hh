@@ -4,6 +4,8 @@
 #include <QString>
 #include <QByteArray>
 
+#include "Origins.hh"
+
 class MessageInfo
 {
 public:
@@ -12,6 +14,7 @@ public:
     MessageInfo(const QString& body, const QString& host, int seqNo);
 
     MessageInfo(const QString& host, int seqNo);
+    MessageInfo(int originId, int seqNo);
 
     void addBody(const QString& body);
     void addLastRoute(quint32 lastIP, quint16 lastPort);
@@ -20,9 +23,13 @@ public:
     // if true, this is a route rumor message and contains no body
     bool m_isRoute;
 
-    QString m_body, m_host;
+    QString m_body;
     int m_seqNo;
 
+    // ID of the ORIGIN of this message in GlobalOrigins
+    int m_originId;
+    const QString& host() const { return GlobalOrigins->name(m_originId); }
+
     bool m_hasLastRoute;
     quint32 m_lastIP;
     quint16 m_lastPort;
@@ -30,6 +37,12 @@ public:
     bool m_hasSig;
     bool m_goodSig;
     QByteArray m_sig;
+
+    // Hops this message took from its origin to reach us; 0 if it's ours
+    int m_hops;
+
+    // Time at which the message was recorded, in ms since the epoch
+    qint64 m_recvTime;
 };
 
 #endif // MESSAGEINFO_HH
@@ -45,3 +45,51 @@ SOURCES += FileData.cc
 
 HEADERS += FileStore.hh
 SOURCES += FileStore.cc
+
+HEADERS += Origins.hh
+SOURCES += Origins.cc
+
+HEADERS += NeighborTable.hh
+SOURCES += NeighborTable.cc
+
+HEADERS += Gossip.hh
+SOURCES += Gossip.cc
+
+HEADERS += TimerWheel.hh
+SOURCES += TimerWheel.cc
+
+HEADERS += FileIndex.hh
+SOURCES += FileIndex.cc
+
+HEADERS += QueryCache.hh
+SOURCES += QueryCache.cc
+
+HEADERS += SearchCache.hh
+SOURCES += SearchCache.cc
+
+HEADERS += BloomFilter.hh
+SOURCES += BloomFilter.cc
+
+HEADERS += Dht.hh
+SOURCES += Dht.cc
+
+HEADERS += SearchManager.hh
+SOURCES += SearchManager.cc
+
+HEADERS += ReplyPages.hh
+SOURCES += ReplyPages.cc
+
+HEADERS += SendQueue.hh
+SOURCES += SendQueue.cc
+
+HEADERS += Admission.hh
+SOURCES += Admission.cc
+
+HEADERS += Fragmenter.hh
+SOURCES += Fragmenter.cc
+
+HEADERS += Rpc.hh
+SOURCES += Rpc.cc
+
+HEADERS += DownloadScheduler.hh
+SOURCES += DownloadScheduler.cc